@@ -0,0 +1,460 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+enum {
+	ENTRY_FREE,
+	ENTRY_BUSY,		/* claimed by a writer, contents in flux */
+	ENTRY_VALID,
+};
+
+struct cache_entry {
+	uint32_t seq;		/* odd while the entry is changing */
+	uint32_t state;
+	uint32_t ref;		/* CLOCK reference bit */
+	uint32_t way;		/* position in the index while listed */
+	uint64_t hash;
+
+	uint64_t off;		/* slot offset in the arena */
+	uint32_t cap;		/* slot size */
+	uint32_t hdrlen;
+	uint32_t bodylen;
+
+	/* what the file looked like when cached */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int64_t checked;
+
+	char path[CACHE_PATH_MAX];
+};
+
+struct cache_class {
+	uint32_t first;		/* first entry of this class */
+	uint32_t count;
+	uint32_t hand;		/* CLOCK hand, relative to first */
+	uint32_t cap;
+};
+
+struct cache {
+	char lock;
+	size_t size;
+	uint32_t nentries;
+	uint32_t nsets;
+
+	struct cache_class classes[CACHE_NCLASSES];
+
+	/* set-associative index of entry number + 1, 0 if empty */
+	uint32_t *index;
+	struct cache_entry *entries;
+	char *arena;
+
+	struct cache_stats stats;
+};
+
+static uint64_t
+cache_hash(const char *path)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void
+cache_lock(struct cache *c)
+{
+	while (__atomic_test_and_set(&c->lock, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void
+cache_unlock(struct cache *c)
+{
+	__atomic_clear(&c->lock, __ATOMIC_RELEASE);
+}
+
+static void
+stat_add(uint64_t *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map `size' bytes of shared memory and carve it into the index, the
+ * entry table and one arena per size class, each class getting an
+ * equal share of the bytes.
+ */
+struct cache *
+cache_create(size_t size)
+{
+	struct cache *c;
+	struct cache_class *cl;
+	size_t share, meta, nentries = 0, off;
+	uint32_t nsets;
+	char *base;
+	int i;
+
+	share = size / CACHE_NCLASSES;
+	for (i = 0; i < CACHE_NCLASSES; i++)
+		nentries += share / ((size_t)CACHE_MIN_SLOT << (2 * i));
+	if (nentries == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* keep the index at most half full */
+	for (nsets = 1; (size_t)nsets * CACHE_WAYS < nentries * 2; nsets <<= 1)
+		; /* empty */
+
+	meta = sizeof(*c) + (size_t)nsets * CACHE_WAYS * sizeof(uint32_t) +
+	    nentries * sizeof(struct cache_entry);
+	meta = (meta + 4095) & ~(size_t)4095;
+	base = mmap(NULL, meta + size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	c = (struct cache *)base;
+	c->size = size;
+	c->nentries = nentries;
+	c->nsets = nsets;
+	c->index = (uint32_t *)(base + sizeof(*c));
+	c->entries = (struct cache_entry *)(c->index + (size_t)nsets * CACHE_WAYS);
+	c->arena = base + meta;
+
+	nentries = 0;
+	off = 0;
+	for (i = 0; i < CACHE_NCLASSES; i++) {
+		cl = &c->classes[i];
+		cl->cap = CACHE_MIN_SLOT << (2 * i);
+		cl->first = nentries;
+		cl->count = share / cl->cap;
+		for (; nentries < cl->first + cl->count; nentries++) {
+			c->entries[nentries].off = off;
+			c->entries[nentries].cap = cl->cap;
+			off += cl->cap;
+		}
+	}
+	return c;
+}
+
+size_t
+cache_max_body(struct cache *c)
+{
+	return c->classes[CACHE_NCLASSES - 1].cap;
+}
+
+/* drop a listed entry; caller holds the lock and the entry is not BUSY */
+static void
+cache_unlist(struct cache *c, struct cache_entry *e)
+{
+	__atomic_store_n(&c->index[e->way], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	e->state = ENTRY_FREE;
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+cache_drop(struct cache *c, const struct cache_ref *ref)
+{
+	struct cache_entry *e = &c->entries[ref->idx];
+
+	cache_lock(c);
+	if (e->seq == ref->seq && e->state == ENTRY_VALID) {
+		cache_unlist(c, e);
+		stat_add(&c->stats.invalidations);
+	}
+	cache_unlock(c);
+}
+
+/*
+ * Find a valid entry for path. Nothing is locked: each candidate is
+ * read between two loads of its sequence number and ignored if a
+ * writer got in between. An entry not checked against the file for
+ * CACHE_REVALIDATE seconds comes back stale; the cache never touches
+ * the file system itself, so the caller finds out how the file is.
+ */
+int
+cache_find(struct cache *c, const char *path, struct cache_ref *ref)
+{
+	struct cache_entry *e;
+	uint64_t h = cache_hash(path);
+	uint32_t *set, idx, seq;
+	int64_t now, checked;
+	int w, match;
+
+	set = &c->index[(h & (c->nsets - 1)) * CACHE_WAYS];
+	for (w = 0; w < CACHE_WAYS; w++) {
+		if ((idx = __atomic_load_n(&set[w], __ATOMIC_RELAXED)) == 0)
+			continue;
+		e = &c->entries[idx - 1];
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		match = e->state == ENTRY_VALID && e->hash == h &&
+		    strncmp(e->path, path, CACHE_PATH_MAX) == 0;
+		ref->idx = idx - 1;
+		ref->seq = seq;
+		ref->hdrlen = e->hdrlen;
+		ref->bodylen = e->bodylen;
+		ref->dev = e->dev;
+		ref->ino = e->ino;
+		ref->size = e->size;
+		ref->mtime = e->mtime;
+		checked = __atomic_load_n(&e->checked, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!match || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		now = time(NULL);
+		ref->stale = now - checked >= CACHE_REVALIDATE;
+		if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0)
+			__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+		stat_add(&c->stats.hits);
+		return 0;
+	}
+	stat_add(&c->stats.misses);
+	return -1;
+}
+
+/*
+ * Settle a stale entry with st, what the file is now, or NULL if it is
+ * gone. An entry made from another version of it is dropped and -1
+ * returned; otherwise it is trusted for CACHE_REVALIDATE seconds more.
+ */
+int
+cache_revalidate(struct cache *c, const struct cache_ref *ref,
+    const struct stat *st)
+{
+	struct cache_entry *e = &c->entries[ref->idx];
+
+	if (st == NULL || st->st_dev != ref->dev || st->st_ino != ref->ino ||
+	    st->st_size != ref->size ||
+	    st->st_mtim.tv_sec != ref->mtime.tv_sec ||
+	    st->st_mtim.tv_nsec != ref->mtime.tv_nsec) {
+		cache_drop(c, ref);
+		return -1;
+	}
+	/* a lost race with a writer only makes the next check early */
+	if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == ref->seq)
+		__atomic_store_n(&e->checked, time(NULL), __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Copy a found entry's head and body out; a NULL body copies the head
+ * only. Returns -1 if the entry changed since cache_find(), in which
+ * case the copies are garbage.
+ */
+int
+cache_copy(struct cache *c, const struct cache_ref *ref, char *hdr, char *body)
+{
+	struct cache_entry *e = &c->entries[ref->idx];
+	const char *slot = c->arena + e->off;
+
+	memcpy(hdr, slot, ref->hdrlen);
+	if (body != NULL)
+		memcpy(body, slot + ref->hdrlen, ref->bodylen);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == ref->seq ? 0 : -1;
+}
+
+/*
+ * Claim a slot that fits len bytes: a free one, or the first entry the
+ * CLOCK hand finds whose reference bit is clear. Caller holds the lock.
+ */
+static struct cache_entry *
+cache_claim(struct cache *c, size_t len)
+{
+	struct cache_class *cl;
+	struct cache_entry *e;
+	uint32_t n;
+	int i;
+
+	for (i = 0; i < CACHE_NCLASSES && c->classes[i].cap < len; i++)
+		; /* empty */
+	if (i == CACHE_NCLASSES)
+		return NULL;
+	cl = &c->classes[i];
+
+	for (n = 0; n < cl->count * 2; n++) {
+		e = &c->entries[cl->first + cl->hand];
+		cl->hand = (cl->hand + 1) % cl->count;
+		if (e->state == ENTRY_BUSY)
+			continue;
+		if (e->state == ENTRY_VALID) {
+			if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+				continue;
+			}
+			cache_unlist(c, e);
+			stat_add(&c->stats.evictions);
+		}
+		__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+		e->state = ENTRY_BUSY;
+		return e;
+	}
+	return NULL;
+}
+
+static void
+cache_release(struct cache *c, struct cache_entry *e)
+{
+	cache_lock(c);
+	__atomic_store_n(&c->index[e->way], 0, __ATOMIC_RELAXED);
+	e->state = ENTRY_FREE;
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	cache_unlock(c);
+}
+
+/*
+ * Cache the contents of fd (already open on path, described by st)
+ * behind the response head hdr. An entry for another version of the
+ * file gives way to it. The slot is claimed and listed under the lock,
+ * but the file is read with the lock dropped; readers skip the entry
+ * until its sequence number turns even again.
+ */
+int
+cache_insert(struct cache *c, const char *path, int fd, const struct stat *st,
+    const char *hdr, size_t hdrlen)
+{
+	struct cache_entry *e, *o;
+	uint64_t h = cache_hash(path);
+	uint32_t *set, way = 0, idx;
+	size_t pathlen = strlen(path);
+	off_t done = 0;
+	ssize_t n;
+	int w, victim = -1;
+
+	if (pathlen >= CACHE_PATH_MAX || !S_ISREG(st->st_mode) ||
+	    hdrlen + (size_t)st->st_size > cache_max_body(c))
+		return -1;
+
+	set = &c->index[(h & (c->nsets - 1)) * CACHE_WAYS];
+	cache_lock(c);
+	for (w = 0; w < CACHE_WAYS; w++) {
+		if ((idx = set[w]) == 0) {
+			if (victim == -1 || set[victim] != 0)
+				victim = w;
+			continue;
+		}
+		o = &c->entries[idx - 1];
+		if (o->hash == h && strcmp(o->path, path) == 0) {
+			/* someone else got here first */
+			if (o->state != ENTRY_VALID || (o->dev == st->st_dev &&
+			    o->ino == st->st_ino && o->size == st->st_size &&
+			    o->mtime.tv_sec == st->st_mtim.tv_sec &&
+			    o->mtime.tv_nsec == st->st_mtim.tv_nsec)) {
+				cache_unlock(c);
+				return -1;
+			}
+			cache_unlist(c, o);
+			stat_add(&c->stats.invalidations);
+			victim = w;
+			continue;
+		}
+		if (o->state == ENTRY_VALID && victim == -1)
+			victim = w;
+	}
+	if (victim == -1 ||
+	    (e = cache_claim(c, hdrlen + st->st_size)) == NULL) {
+		cache_unlock(c);
+		return -1;
+	}
+	if (set[victim] != 0) {
+		/* the set is full: push out a valid neighbour */
+		o = &c->entries[set[victim] - 1];
+		if (o->state == ENTRY_VALID) {
+			cache_unlist(c, o);
+			stat_add(&c->stats.evictions);
+		}
+	}
+	if (set[victim] != 0) {
+		e->state = ENTRY_FREE;
+		__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+		cache_unlock(c);
+		return -1;
+	}
+	way = (set - c->index) + victim;
+	e->way = way;
+	e->hash = h;
+	memcpy(e->path, path, pathlen + 1);
+	__atomic_store_n(&set[victim], (e - c->entries) + 1, __ATOMIC_RELAXED);
+	cache_unlock(c);
+
+	memcpy(c->arena + e->off, hdr, hdrlen);
+	while (done < st->st_size) {
+		n = pread(fd, c->arena + e->off + hdrlen + done,
+		    st->st_size - done, done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			cache_release(c, e);
+			return -1;
+		}
+		done += n;
+	}
+
+	e->hdrlen = hdrlen;
+	e->bodylen = st->st_size;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	__atomic_store_n(&e->checked, time(NULL), __ATOMIC_RELAXED);
+	e->ref = 0;
+
+	cache_lock(c);
+	e->state = ENTRY_VALID;
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	cache_unlock(c);
+	stat_add(&c->stats.inserts);
+	return 0;
+}
+
+void
+cache_invalidate(struct cache *c, const char *path)
+{
+	struct cache_entry *e;
+	uint64_t h = cache_hash(path);
+	uint32_t *set, idx;
+	int w;
+
+	set = &c->index[(h & (c->nsets - 1)) * CACHE_WAYS];
+	cache_lock(c);
+	for (w = 0; w < CACHE_WAYS; w++) {
+		if ((idx = set[w]) == 0)
+			continue;
+		e = &c->entries[idx - 1];
+		if (e->state == ENTRY_VALID && e->hash == h &&
+		    strcmp(e->path, path) == 0) {
+			cache_unlist(c, e);
+			stat_add(&c->stats.invalidations);
+		}
+	}
+	cache_unlock(c);
+}
+
+void
+cache_stats(struct cache *c, struct cache_stats *st)
+{
+	st->hits = __atomic_load_n(&c->stats.hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&c->stats.misses, __ATOMIC_RELAXED);
+	st->inserts = __atomic_load_n(&c->stats.inserts, __ATOMIC_RELAXED);
+	st->evictions = __atomic_load_n(&c->stats.evictions, __ATOMIC_RELAXED);
+	st->invalidations = __atomic_load_n(&c->stats.invalidations,
+	    __ATOMIC_RELAXED);
+}
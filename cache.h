@@ -0,0 +1,59 @@
+#ifndef cache_h
+#define cache_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#define CACHE_PATH_MAX (256)
+#define CACHE_NCLASSES (4)
+#define CACHE_MIN_SLOT (2 * 1024)	/* classes are 2K, 8K, 32K, 128K */
+#define CACHE_WAYS (8)
+#define CACHE_REVALIDATE (1)		/* seconds between checks of the file */
+
+/*
+ * Hot-file cache shared by all workers. The master maps it before
+ * starting them; workers look entries up without locking (each entry is a
+ * seqlock) and take a short spinlock only to insert or invalidate.
+ * Entries hold a pre-serialized response head and the file body.
+ */
+struct cache;
+
+/* a lookup result, valid until cache_copy() says otherwise */
+struct cache_ref {
+	uint32_t idx;
+	uint32_t seq;
+	size_t hdrlen;
+	size_t bodylen;
+
+	/* the file the entry was read from, for validators */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	int stale;		/* cache_revalidate() before using it */
+};
+
+struct cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t invalidations;
+};
+
+struct cache	*cache_create(size_t size);
+size_t		 cache_max_body(struct cache *);
+int		 cache_find(struct cache *, const char *path, struct cache_ref *);
+int		 cache_revalidate(struct cache *, const struct cache_ref *,
+		    const struct stat *);
+int		 cache_copy(struct cache *, const struct cache_ref *,
+		    char *hdr, char *body);
+int		 cache_insert(struct cache *, const char *path, int fd,
+		    const struct stat *, const char *hdr, size_t hdrlen);
+void		 cache_invalidate(struct cache *, const char *path);
+void		 cache_stats(struct cache *, struct cache_stats *);
+
+#endif
@@ -0,0 +1,358 @@
+#include <sys/inotify.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+    IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | \
+    IN_MOVED_TO | IN_ONLYDIR)
+
+struct fdwatch;
+
+struct fdentry {
+	LIST_ENTRY(fdentry) chain;	/* hash bucket */
+	LIST_ENTRY(fdentry) sibling;	/* entries in the same directory */
+	TAILQ_ENTRY(fdentry) lru;
+	struct fdwatch *watch;		/* NULL if only the TTL applies */
+	uint64_t hash;
+	time_t expires;
+	int fd;				/* -1 for a failed lookup */
+	int error;			/* errno of the failed lookup */
+	struct stat st;
+	size_t base;			/* offset of the last path component */
+	char path[];
+};
+
+/* one inotify watch per directory that holds cached entries */
+struct fdwatch {
+	LIST_ENTRY(fdwatch) entry;
+	LIST_HEAD(, fdentry) entries;
+	int wd;
+	size_t len;
+	char dir[];			/* the watched path, not terminated */
+};
+
+struct fdcache {
+	LIST_HEAD(, fdentry) *buckets;
+	size_t mask;
+	TAILQ_HEAD(fdentry_lru, fdentry) lru;
+	size_t count;
+	size_t max;
+	int ttl;
+
+	int ifd;			/* inotify instance, -1 if unavailable */
+	LIST_HEAD(, fdwatch) watches;
+
+	struct fdcache_stats stats;
+};
+
+static uint64_t
+fdcache_hash(const char *path)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static time_t
+fdcache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+struct fdcache *
+fdcache_create(size_t nentries, int ttl)
+{
+	struct fdcache *fc;
+	size_t i, nbuckets = 1;
+
+	while (nbuckets < nentries)
+		nbuckets <<= 1;
+	if ((fc = calloc(1, sizeof(*fc))) == NULL)
+		return NULL;
+	if ((fc->buckets = calloc(nbuckets, sizeof(*fc->buckets))) == NULL) {
+		free(fc);
+		return NULL;
+	}
+	for (i = 0; i < nbuckets; i++)
+		LIST_INIT(&fc->buckets[i]);
+	fc->mask = nbuckets - 1;
+	TAILQ_INIT(&fc->lru);
+	LIST_INIT(&fc->watches);
+	fc->max = nentries;
+	fc->ttl = ttl;
+	fc->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return fc;
+}
+
+int
+fdcache_notify_fd(struct fdcache *fc)
+{
+	return fc->ifd;
+}
+
+static void
+fdwatch_release(struct fdcache *fc, struct fdwatch *w)
+{
+	if (w == NULL || !LIST_EMPTY(&w->entries))
+		return;
+	inotify_rm_watch(fc->ifd, w->wd);
+	LIST_REMOVE(w, entry);
+	free(w);
+}
+
+/* the watch for the directory of path, NULL if it cannot be watched */
+static struct fdwatch *
+fdwatch_get(struct fdcache *fc, const char *path, size_t base)
+{
+	struct fdwatch *w;
+	char dir[PATH_MAX];
+	int wd;
+
+	if (fc->ifd == -1 || base == 0 || base > sizeof(dir))
+		return NULL;
+	LIST_FOREACH(w, &fc->watches, entry)
+		if (w->len == base - 1 && memcmp(w->dir, path, base - 1) == 0)
+			return w;
+	memcpy(dir, path, base - 1);
+	dir[base - 1] = '\0';
+	/* another spelling of a watched directory yields its descriptor */
+	if ((wd = inotify_add_watch(fc->ifd, dir, WATCH_MASK)) == -1)
+		return NULL;
+	LIST_FOREACH(w, &fc->watches, entry)
+		if (w->wd == wd)
+			return w;
+	if ((w = malloc(sizeof(*w) + base - 1)) == NULL) {
+		inotify_rm_watch(fc->ifd, wd);
+		return NULL;
+	}
+	w->len = base - 1;
+	memcpy(w->dir, path, base - 1);
+	w->wd = wd;
+	LIST_INIT(&w->entries);
+	LIST_INSERT_HEAD(&fc->watches, w, entry);
+	return w;
+}
+
+/* unlink and free an entry, leaving its watch to the caller */
+static void
+fdentry_free(struct fdcache *fc, struct fdentry *e)
+{
+	LIST_REMOVE(e, chain);
+	if (e->watch != NULL)
+		LIST_REMOVE(e, sibling);
+	TAILQ_REMOVE(&fc->lru, e, lru);
+	fc->count--;
+	if (e->fd != -1)
+		close(e->fd);
+	free(e);
+}
+
+static void
+fdcache_drop(struct fdcache *fc, struct fdentry *e)
+{
+	struct fdwatch *w = e->watch;
+
+	fdentry_free(fc, e);
+	fdwatch_release(fc, w);
+}
+
+static struct fdentry *
+fdcache_lookup(struct fdcache *fc, const char *path, uint64_t h)
+{
+	struct fdentry *e;
+
+	LIST_FOREACH(e, &fc->buckets[h & fc->mask], chain)
+		if (e->hash == h && strcmp(e->path, path) == 0)
+			return e;
+	return NULL;
+}
+
+static struct fdentry *
+fdcache_insert(struct fdcache *fc, const char *path, uint64_t h)
+{
+	struct fdentry *e;
+	const char *slash;
+	size_t len = strlen(path);
+
+	if (fc->count >= fc->max)
+		fdcache_drop(fc, TAILQ_LAST(&fc->lru, fdentry_lru));
+	if ((e = malloc(sizeof(*e) + len + 1)) == NULL)
+		return NULL;
+	memcpy(e->path, path, len + 1);
+	slash = strrchr(path, '/');
+	e->base = slash == NULL ? 0 : (size_t)(slash - path) + 1;
+	e->hash = h;
+	e->expires = fdcache_now() + fc->ttl;
+	e->fd = -1;
+	e->error = 0;
+	if ((e->watch = fdwatch_get(fc, path, e->base)) != NULL)
+		LIST_INSERT_HEAD(&e->watch->entries, e, sibling);
+	LIST_INSERT_HEAD(&fc->buckets[h & fc->mask], e, chain);
+	TAILQ_INSERT_HEAD(&fc->lru, e, lru);
+	fc->count++;
+	return e;
+}
+
+/* the unexpired entry for path, counted; NULL with errno EAGAIN if none */
+static struct fdentry *
+fdcache_live(struct fdcache *fc, const char *path)
+{
+	struct fdentry *e;
+
+	if ((e = fdcache_lookup(fc, path, fdcache_hash(path))) != NULL) {
+		if (e->expires > fdcache_now()) {
+			TAILQ_REMOVE(&fc->lru, e, lru);
+			TAILQ_INSERT_HEAD(&fc->lru, e, lru);
+			if (e->fd == -1)
+				fc->stats.negative_hits++;
+			else
+				fc->stats.hits++;
+			return e;
+		}
+		fdcache_drop(fc, e);
+	}
+	fc->stats.misses++;
+	errno = EAGAIN;
+	return NULL;
+}
+
+/*
+ * Look path up without touching the disk. Returns a new descriptor the
+ * caller owns and fills in st, or -1 with errno set: the original errno
+ * of a cached failure, or EAGAIN if nothing is cached for path.
+ */
+int
+fdcache_get(struct fdcache *fc, const char *path, struct stat *st)
+{
+	struct fdentry *e;
+
+	if ((e = fdcache_live(fc, path)) == NULL)
+		return -1;
+	if (e->fd == -1) {
+		errno = e->error;
+		return -1;
+	}
+	*st = e->st;
+	return fcntl(e->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/* like fdcache_get(), for the stat() result alone: 0 instead of an fd */
+int
+fdcache_stat(struct fdcache *fc, const char *path, struct stat *st)
+{
+	struct fdentry *e;
+
+	if ((e = fdcache_live(fc, path)) == NULL)
+		return -1;
+	if (e->fd == -1) {
+		errno = e->error;
+		return -1;
+	}
+	*st = e->st;
+	return 0;
+}
+
+/*
+ * Remember what opening path gave after a miss: the caller's fd, which
+ * it keeps, and st, or the errno the open failed with.
+ */
+void
+fdcache_put(struct fdcache *fc, const char *path, int fd, struct stat *st,
+    int error)
+{
+	struct fdentry *e;
+	uint64_t h = fdcache_hash(path);
+
+	if (fd == -1 && error != ENOENT && error != ENOTDIR && error != EACCES)
+		return;
+	/* someone else may have looked it up meanwhile */
+	if ((e = fdcache_lookup(fc, path, h)) != NULL)
+		fdcache_drop(fc, e);
+	if ((e = fdcache_insert(fc, path, h)) == NULL)
+		return;
+	if (fd == -1) {
+		e->error = error;
+		return;
+	}
+	e->st = *st;
+	if ((e->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1)
+		fdcache_drop(fc, e);
+}
+
+static void
+fdcache_invalidate(struct fdcache *fc, struct fdentry *e, fdcache_cb cb,
+    void *arg)
+{
+	fc->stats.invalidations++;
+	if (cb != NULL)
+		cb(e->path, arg);
+	fdentry_free(fc, e);
+}
+
+/*
+ * Drain pending inotify events and drop the entries they touch. A
+ * change to a directory itself, or a lost event, drops every entry
+ * that might depend on it.
+ */
+void
+fdcache_notify(struct fdcache *fc, fdcache_cb cb, void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct fdwatch *w;
+	struct fdentry *e, *next;
+	ssize_t n;
+	char *p;
+
+	while ((n = read(fc->ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (e = TAILQ_FIRST(&fc->lru); e != NULL; e = next) {
+					next = TAILQ_NEXT(e, lru);
+					w = e->watch;
+					fdcache_invalidate(fc, e, cb, arg);
+					fdwatch_release(fc, w);
+				}
+				continue;
+			}
+			LIST_FOREACH(w, &fc->watches, entry)
+				if (w->wd == ev->wd)
+					break;
+			if (w == NULL)
+				continue;
+			for (e = LIST_FIRST(&w->entries); e != NULL; e = next) {
+				next = LIST_NEXT(e, sibling);
+				if (ev->len == 0 ||
+				    strcmp(e->path + e->base, ev->name) == 0)
+					fdcache_invalidate(fc, e, cb, arg);
+			}
+			fdwatch_release(fc, w);
+		}
+	}
+}
+
+void
+fdcache_stats(struct fdcache *fc, struct fdcache_stats *st)
+{
+	*st = fc->stats;
+}
@@ -0,0 +1,39 @@
+#ifndef fdcache_h
+#define fdcache_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+#define FDCACHE_SIZE (256)	/* entries, each positive one holds an fd */
+#define FDCACHE_TTL (10)	/* seconds an entry is trusted without notice */
+
+/*
+ * Per-worker cache of open files, their stat() results and failed
+ * lookups, keyed by path. Entries expire after FDCACHE_TTL seconds or
+ * as soon as inotify reports a change in their directory, whichever
+ * comes first. Not shared: every worker keeps its own fds.
+ */
+struct fdcache;
+
+struct fdcache_stats {
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+/* called with each path that inotify invalidated */
+typedef void (*fdcache_cb)(const char *path, void *arg);
+
+struct fdcache	*fdcache_create(size_t nentries, int ttl);
+int		 fdcache_get(struct fdcache *, const char *path, struct stat *);
+int		 fdcache_stat(struct fdcache *, const char *path, struct stat *);
+void		 fdcache_put(struct fdcache *, const char *path, int fd,
+		    struct stat *, int error);
+int		 fdcache_notify_fd(struct fdcache *);
+void		 fdcache_notify(struct fdcache *, fdcache_cb, void *arg);
+void		 fdcache_stats(struct fdcache *, struct fdcache_stats *);
+
+#endif
@@ -33,6 +33,7 @@ typedef enum {
 	HTTP_415,
 	HTTP_416,
 	HTTP_417,
+	HTTP_431,
 	HTTP_500,
 	HTTP_501,
 	HTTP_502,
@@ -76,6 +77,7 @@ char *http_status_string[] = {
 	[HTTP_415] = "415 Unsupported Media Type",
 	[HTTP_416] = "416 Requested range not satisfiable",
 	[HTTP_417] = "417 Expectation Failed",
+	[HTTP_431] = "431 Request Header Fields Too Large",
 	[HTTP_500] = "500 Internal Server Error",
 	[HTTP_501] = "501 Not Implemented",
 	[HTTP_502] = "502 Bad Gateway",
@@ -83,3 +85,31 @@ char *http_status_string[] = {
 	[HTTP_504] = "504 Gateway Time-out",
 	[HTTP_505] = "505 HTTP Version not supported"
 };
+
+/* request headers the server looks at, indexed as they are parsed */
+typedef enum {
+	HDR_ACCEPT_ENCODING,
+	HDR_CONNECTION,
+	HDR_CONTENT_LENGTH,
+	HDR_EXPECT,
+	HDR_HOST,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_IF_NONE_MATCH,
+	HDR_IF_RANGE,
+	HDR_RANGE,
+	HDR_TRANSFER_ENCODING,
+	HDR_UNKNOWN,
+} HTTP_HEADER;
+
+char *http_header_string[] = {
+	[HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+	[HDR_CONNECTION] = "Connection",
+	[HDR_CONTENT_LENGTH] = "Content-Length",
+	[HDR_EXPECT] = "Expect",
+	[HDR_HOST] = "Host",
+	[HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+	[HDR_IF_NONE_MATCH] = "If-None-Match",
+	[HDR_IF_RANGE] = "If-Range",
+	[HDR_RANGE] = "Range",
+	[HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+};
@@ -0,0 +1,270 @@
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define MIN_LEN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+ * Single-producer, single-consumer byte ring, one per thread that
+ * logs. head and tail only ever grow; the producer owns head, the
+ * flusher owns tail, and each reads the other's with acquire ordering.
+ */
+struct log_ring {
+	char buf[LOG_RING_SIZE];
+	size_t head;
+	size_t tail;
+	unsigned long long dropped;
+	unsigned long long reported;	/* flusher only */
+	char name[64];
+	struct log_ring *next;
+};
+
+static int log_fd = -1;
+static int log_level = LVL_INFO;
+static char log_name[64];
+
+/* every thread's ring, newest first; rings are never unlinked */
+static struct log_ring *log_rings;
+static __thread struct log_ring *log_self;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_async;
+static int log_stopping;
+static int log_wakefd = -1;
+static pthread_t log_thread;
+
+int
+log_init(int fd, int level, const char *name)
+{
+	log_fd = fd;
+	log_level = level;
+	snprintf(log_name, sizeof(log_name), "%s", name);
+	return 0;
+}
+
+int
+log_enabled(int level)
+{
+	return level <= log_level;
+}
+
+/* lines this thread could not queue */
+unsigned long long
+log_dropped(void)
+{
+	if (log_self == NULL)
+		return 0;
+	return __atomic_load_n(&log_self->dropped, __ATOMIC_RELAXED);
+}
+
+static void
+log_write(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(log_fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* write out everything published to one ring so far */
+static void
+log_drain_ring(struct log_ring *ring)
+{
+	struct iovec iov[2];
+	size_t head, tail, off, len;
+	unsigned long long dropped;
+	char line[LOG_LINE_MAX];
+	ssize_t n;
+	int iovcnt;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		off = tail & (LOG_RING_SIZE - 1);
+		len = head - tail;
+		iov[0].iov_base = ring->buf + off;
+		iov[0].iov_len = MIN_LEN(len, LOG_RING_SIZE - off);
+		iovcnt = 1;
+		if (iov[0].iov_len < len) {
+			iov[1].iov_base = ring->buf;
+			iov[1].iov_len = len - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		if ((n = writev(log_fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			n = len;	/* can't log; don't wedge the ring */
+		}
+		tail += n;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+		n = snprintf(line, sizeof(line), "[%s] log: dropped %llu lines\n",
+		    ring->name, dropped - ring->reported);
+		log_write(line, n);
+		ring->reported = dropped;
+	}
+}
+
+/* flusher thread only */
+static void
+log_drain(void)
+{
+	struct log_ring *ring;
+
+	for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+	    ring != NULL; ring = ring->next)
+		log_drain_ring(ring);
+}
+
+static void *
+log_flusher(void *arg)
+{
+	struct pollfd pfd;
+	uint64_t v;
+
+	(void)arg;
+	pfd.fd = log_wakefd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, LOG_FLUSH_MS) == 1)
+			read(log_wakefd, &v, sizeof(v));
+		log_drain();
+		if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+			break;
+	}
+	log_drain();
+	return NULL;
+}
+
+/*
+ * Name the calling thread's messages and give it a ring of its own,
+ * starting the process's flusher on the first call.
+ */
+int
+log_start(const char *name)
+{
+	struct log_ring *ring;
+	int ret = -1;
+
+	if ((ring = calloc(1, sizeof(*ring))) == NULL)
+		return -1;
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+
+	pthread_mutex_lock(&log_lock);
+	if (!log_async) {
+		log_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (log_wakefd == -1)
+			goto out;
+		log_stopping = 0;
+		if (pthread_create(&log_thread, NULL, log_flusher, NULL) != 0) {
+			close(log_wakefd);
+			log_wakefd = -1;
+			goto out;
+		}
+		__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	}
+	ring->next = log_rings;
+	__atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+	log_self = ring;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&log_lock);
+	if (ret == -1)
+		free(ring);
+	return ret;
+}
+
+/* stop the flusher once it has written everything queued */
+void
+log_close(void)
+{
+	uint64_t v = 1;
+
+	pthread_mutex_lock(&log_lock);
+	if (!log_async) {
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	write(log_wakefd, &v, sizeof(v));
+	pthread_join(log_thread, NULL);
+	__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+	close(log_wakefd);
+	log_wakefd = -1;
+	pthread_mutex_unlock(&log_lock);
+}
+
+void
+log_vmsg(int level, const char *fmt, va_list ap)
+{
+	struct log_ring *ring = log_self;
+	char line[LOG_LINE_MAX];
+	size_t head, tail, used, off, len, first;
+	uint64_t v = 1;
+	int n, m;
+
+	if (level > log_level || log_fd == -1)
+		return;
+
+	n = snprintf(line, sizeof(line), "[%s] ",
+	    ring != NULL ? ring->name : log_name);
+	m = vsnprintf(line + n, sizeof(line) - n - 1, fmt, ap);
+	if (m < 0)
+		return;
+	len = MIN_LEN((size_t)n + m, sizeof(line) - 2);
+	line[len++] = '\n';
+
+	if (ring == NULL || !__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+		log_write(line, len);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	used = head - tail;
+	if (LOG_RING_SIZE - used < len) {
+		/* never block the event loop on the log */
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	off = head & (LOG_RING_SIZE - 1);
+	first = MIN_LEN(len, LOG_RING_SIZE - off);
+	memcpy(ring->buf + off, line, first);
+	memcpy(ring->buf, line + first, len - first);
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+	/* wake the flusher early once the ring passes half full */
+	if (used < LOG_RING_SIZE / 2 && used + len >= LOG_RING_SIZE / 2)
+		write(log_wakefd, &v, sizeof(v));
+}
+
+void
+log_msg(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vmsg(level, fmt, ap);
+	va_end(ap);
+}
@@ -0,0 +1,43 @@
+#ifndef log_h
+#define log_h
+
+#include <stdarg.h>
+
+enum {
+	LVL_ERR,
+	LVL_INFO,
+	LVL_DEBUG,
+};
+
+/* messages above this level are compiled out entirely */
+#ifndef LOG_MAXLEVEL
+#define LOG_MAXLEVEL LVL_INFO
+#endif
+
+#define LOG_RING_SIZE (256 * 1024)	/* per thread, power of two */
+#define LOG_LINE_MAX (512)
+#define LOG_FLUSH_MS (100)
+
+/*
+ * Messages are formatted on the caller's thread into that thread's
+ * ring buffer and written out in batches by the process's flusher
+ * thread. Until a thread calls log_start(), and after log_close(),
+ * its messages are written synchronously; that keeps the rings empty
+ * across fork().
+ */
+int	 log_init(int fd, int level, const char *name);
+int	 log_start(const char *name);
+void	 log_close(void);
+
+void	 log_msg(int level, const char *fmt, ...)
+	    __attribute__((format(printf, 2, 3)));
+void	 log_vmsg(int level, const char *fmt, va_list ap);
+int	 log_enabled(int level);
+unsigned long long log_dropped(void);
+
+#define log_debug(...) do {						\
+	if (LOG_MAXLEVEL >= LVL_DEBUG && log_enabled(LVL_DEBUG))	\
+		log_msg(LVL_DEBUG, __VA_ARGS__);			\
+} while (0)
+
+#endif
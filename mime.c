@@ -0,0 +1,199 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+#define MIME_EXT_MAX (8)	/* longer extensions don't pack */
+
+/* an extension's bytes, lowercase, the first in the low byte */
+#define K1(a) ((uint64_t)(unsigned char)(a))
+#define K2(a, b) (K1(a) | K1(b) << 8)
+#define K3(a, b, c) (K2(a, b) | K1(c) << 16)
+#define K4(a, b, c, d) (K3(a, b, c) | K1(d) << 24)
+#define K5(a, b, c, d, e) (K4(a, b, c, d) | K1(e) << 32)
+
+struct mime_override {
+	uint64_t key;
+	char *type;
+};
+
+static struct mime_override *overrides;
+static size_t noverrides;
+
+/* the extension packed into a key, or 0 if it is empty or too long */
+static uint64_t
+mime_key(const char *ext, size_t len)
+{
+	uint64_t key = 0;
+	size_t i;
+
+	if (len == 0 || len > MIME_EXT_MAX)
+		return 0;
+	for (i = 0; i < len; i++)
+		key |= K1(tolower((unsigned char)ext[i])) << (8 * i);
+	return key;
+}
+
+static const char *
+mime_builtin(uint64_t key)
+{
+	switch (key) {
+	case K4('h', 't', 'm', 'l'):
+	case K3('h', 't', 'm'):
+		return "text/html";
+	case K3('c', 's', 's'):
+		return "text/css";
+	case K2('j', 's'):
+	case K3('m', 'j', 's'):
+		return "text/javascript";
+	case K3('t', 'x', 't'):
+		return "text/plain";
+	case K3('c', 's', 'v'):
+		return "text/csv";
+	case K2('m', 'd'):
+		return "text/markdown";
+	case K3('x', 'm', 'l'):
+		return "application/xml";
+	case K4('j', 's', 'o', 'n'):
+	case K3('m', 'a', 'p'):
+		return "application/json";
+	case K4('w', 'a', 's', 'm'):
+		return "application/wasm";
+	case K3('p', 'd', 'f'):
+		return "application/pdf";
+	case K3('z', 'i', 'p'):
+		return "application/zip";
+	case K2('g', 'z'):
+		return "application/gzip";
+	case K3('t', 'a', 'r'):
+		return "application/x-tar";
+	case K3('s', 'v', 'g'):
+		return "image/svg+xml";
+	case K3('p', 'n', 'g'):
+		return "image/png";
+	case K3('j', 'p', 'g'):
+	case K4('j', 'p', 'e', 'g'):
+		return "image/jpeg";
+	case K3('g', 'i', 'f'):
+		return "image/gif";
+	case K4('w', 'e', 'b', 'p'):
+		return "image/webp";
+	case K4('a', 'v', 'i', 'f'):
+		return "image/avif";
+	case K3('i', 'c', 'o'):
+		return "image/vnd.microsoft.icon";
+	case K4('w', 'o', 'f', 'f'):
+		return "font/woff";
+	case K5('w', 'o', 'f', 'f', '2'):
+		return "font/woff2";
+	case K3('t', 't', 'f'):
+		return "font/ttf";
+	case K3('o', 't', 'f'):
+		return "font/otf";
+	case K3('m', 'p', '4'):
+		return "video/mp4";
+	case K4('w', 'e', 'b', 'm'):
+		return "video/webm";
+	case K3('m', 'p', '3'):
+		return "audio/mpeg";
+	case K3('o', 'g', 'g'):
+		return "audio/ogg";
+	case K3('w', 'a', 'v'):
+		return "audio/wav";
+	default:
+		return NULL;
+	}
+}
+
+static int
+mime_cmp(const void *a, const void *b)
+{
+	const struct mime_override *x = a, *y = b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* the type for the extension of the last component of path */
+const char *
+mime_type(const char *path)
+{
+	struct mime_override want, *o;
+	const char *base, *dot;
+	const char *type;
+	uint64_t key;
+
+	if ((base = strrchr(path, '/')) == NULL)
+		base = path;
+	if ((dot = strrchr(base, '.')) == NULL ||
+	    (key = mime_key(dot + 1, strlen(dot + 1))) == 0)
+		return MIME_DEFAULT;
+	if (noverrides > 0) {
+		want.key = key;
+		if ((o = bsearch(&want, overrides, noverrides,
+		    sizeof(*overrides), mime_cmp)) != NULL)
+			return o->type;
+	}
+	return (type = mime_builtin(key)) != NULL ? type : MIME_DEFAULT;
+}
+
+/*
+ * Read a mime.types file: lines of a type and its extensions, with #
+ * comments. A later line for an extension wins over an earlier one.
+ */
+int
+mime_load(const char *file)
+{
+	struct mime_override *o;
+	FILE *fp;
+	char line[1024], *p, *type, *ext, *copy;
+	uint64_t key;
+	size_t i, cap = noverrides;
+
+	if ((fp = fopen(file, "re")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if ((type = strtok(line, " \t\r\n")) == NULL ||
+		    strlen(type) > MIME_TYPE_MAX)
+			continue;
+		while ((ext = strtok(NULL, " \t\r\n;")) != NULL) {
+			if ((key = mime_key(ext, strlen(ext))) == 0)
+				continue;
+			if ((copy = strdup(type)) == NULL)
+				goto fail;
+			for (i = 0; i < noverrides; i++)
+				if (overrides[i].key == key)
+					break;
+			if (i < noverrides) {
+				free(overrides[i].type);
+				overrides[i].type = copy;
+				continue;
+			}
+			if (noverrides == cap) {
+				cap = cap ? cap * 2 : 64;
+				if ((o = realloc(overrides,
+				    cap * sizeof(*o))) == NULL) {
+					free(copy);
+					goto fail;
+				}
+				overrides = o;
+			}
+			overrides[noverrides].key = key;
+			overrides[noverrides].type = copy;
+			noverrides++;
+		}
+	}
+	fclose(fp);
+	qsort(overrides, noverrides, sizeof(*overrides), mime_cmp);
+	return 0;
+
+fail:
+	fclose(fp);
+	errno = ENOMEM;
+	return -1;
+}
@@ -0,0 +1,17 @@
+#ifndef mime_h
+#define mime_h
+
+#define MIME_DEFAULT "application/octet-stream"
+#define MIME_TYPE_MAX (96)	/* longest type a file may set */
+
+/*
+ * Content types by file extension. The built-in table is a switch on
+ * the extension's bytes packed into an integer, so a lookup neither
+ * allocates nor compares strings. A mime.types file loaded at startup
+ * overrides and extends it; load it before the workers start, the
+ * table is read-only after that.
+ */
+const char	*mime_type(const char *path);
+int		 mime_load(const char *file);
+
+#endif
@@ -27,7 +27,11 @@
 #include <assert.h>
 #include <stddef.h>
 #include <string.h>
-#ifdef __SSE4_2__
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* kernels are compiled per target and picked at startup from CPUID */
+#define FINDCHAR_DISPATCH 1
+#include <x86intrin.h>
+#elif defined(__SSE4_2__)
 #ifdef _MSC_VER
 #include <nmmintrin.h>
 #else
@@ -73,9 +77,8 @@
 #define ADVANCE_TOKEN(tok, toklen)                                                                                                 \
     do {                                                                                                                           \
         const char *tok_start = buf;                                                                                               \
-        static const char ALIGNED(16) ranges2[] = "\000\040\177\177";                                                              \
         int found2;                                                                                                                \
-        buf = findchar_fast(buf, buf_end, ranges2, sizeof(ranges2) - 1, &found2);                                                  \
+        buf = findchar_fast(buf, buf_end, &token_set, &found2);                                                                    \
         if (!found2) {                                                                                                             \
             CHECK_EOF();                                                                                                           \
         }                                                                                                                          \
@@ -104,17 +107,59 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
-static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+/*
+ * findchar_fast() skips ahead to the first byte of a set, described by up
+ * to 8 inclusive [lo, hi] byte pairs. It only looks at whole vectors and
+ * leaves the rest to the byte-at-a-time loops of the callers; *found
+ * tells whether it stopped on a match.
+ *
+ * SSE4.2 matches the pairs directly with PCMPESTRI. AVX2 and AVX-512 have
+ * no range compare, so each set is also turned into two 16-entry tables
+ * indexed by the low and high nibble of a byte: a byte is in the set iff
+ * the two entries share a bit, which takes two shuffles per vector.
+ */
+struct findchar_set {
+    char ALIGNED(16) ranges[16];
+    int ranges_size;
+    unsigned char ALIGNED(16) lo_nibble[16];
+    unsigned char ALIGNED(16) hi_nibble[16];
+};
+
+#define FINDCHAR_SET(r)                                                                                                            \
+    {                                                                                                                              \
+        r, sizeof(r) - 1, {0}, {0}                                                                                                 \
+    }
+
+/* non-printable characters and SP, which end a token */
+static struct findchar_set token_set = FINDCHAR_SET("\000\040\177\177");
+
+/* control characters but HT, which end a line; chars w. MSB set are allowed */
+static struct findchar_set eol_set = FINDCHAR_SET("\0\010\012\037\177\177");
+
+/* anything not allowed in a header name */
+static struct findchar_set header_name_set = FINDCHAR_SET("\x00 "  /* control chars and up to SP */
+                                                          "\"\""   /* 0x22 */
+                                                          "()"     /* 0x28,0x29 */
+                                                          ",,"     /* 0x2c */
+                                                          "//"     /* 0x2f */
+                                                          ":@"     /* 0x3a-0x40 */
+                                                          "[]"     /* 0x5b-0x5d */
+                                                          "{\377"); /* 0x7b-0xff */
+
+#if FINDCHAR_DISPATCH || __SSE4_2__
+#if FINDCHAR_DISPATCH
+__attribute__((target("sse4.2")))
+#endif
+static const char *findchar_sse42(const char *buf, const char *buf_end, const struct findchar_set *set, int *found)
 {
     *found = 0;
-#if __SSE4_2__
     if (likely(buf_end - buf >= 16)) {
-        __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+        __m128i ranges16 = _mm_load_si128((const __m128i *)set->ranges);
 
         size_t left = (buf_end - buf) & ~15;
         do {
             __m128i b16 = _mm_loadu_si128((const __m128i *)buf);
-            int r = _mm_cmpestri(ranges16, ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+            int r = _mm_cmpestri(ranges16, set->ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
             if (unlikely(r != 16)) {
                 buf += r;
                 *found = 1;
@@ -124,57 +169,171 @@ static const char *findchar_fast(const char *buf, const char *buf_end, const cha
             left -= 16;
         } while (likely(left != 0));
     }
-#else
+    return buf;
+}
+#endif
+
+#if FINDCHAR_DISPATCH
+__attribute__((target("avx2"))) static const char *findchar_avx2(const char *buf, const char *buf_end,
+                                                                  const struct findchar_set *set, int *found)
+{
+    *found = 0;
+    if (likely(buf_end - buf >= 32)) {
+        __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)set->lo_nibble));
+        __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)set->hi_nibble));
+        __m256i nibble = _mm256_set1_epi8(0x0f);
+
+        do {
+            __m256i b32 = _mm256_loadu_si256((const __m256i *)buf);
+            __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(b32, nibble));
+            __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(b32, 4), nibble));
+            __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+            unsigned mask = ~(unsigned)_mm256_movemask_epi8(miss);
+            if (unlikely(mask != 0)) {
+                buf += __builtin_ctz(mask);
+                *found = 1;
+                break;
+            }
+            buf += 32;
+        } while (likely(buf_end - buf >= 32));
+    }
+    return buf;
+}
+
+/* AVX-512BW also covers the tail, with a masked load */
+__attribute__((target("avx512f,avx512bw"))) static const char *findchar_avx512(const char *buf, const char *buf_end,
+                                                                               const struct findchar_set *set, int *found)
+{
+    __m512i lo = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)set->lo_nibble));
+    __m512i hi = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)set->hi_nibble));
+    __m512i nibble = _mm512_set1_epi8(0x0f);
+    __mmask64 valid = ~(__mmask64)0, hit;
+    __m512i b64;
+
+    *found = 0;
+    while (buf != buf_end) {
+        if (likely(buf_end - buf >= 64)) {
+            b64 = _mm512_loadu_si512((const void *)buf);
+        } else {
+            valid = ((__mmask64)1 << (buf_end - buf)) - 1;
+            b64 = _mm512_maskz_loadu_epi8(valid, buf);
+        }
+        hit = _mm512_mask_test_epi8_mask(valid, _mm512_shuffle_epi8(lo, _mm512_and_si512(b64, nibble)),
+                                         _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(b64, 4), nibble)));
+        if (unlikely(hit != 0)) {
+            buf += __builtin_ctzll(hit);
+            *found = 1;
+            break;
+        }
+        buf = buf_end - buf >= 64 ? buf + 64 : buf_end;
+    }
+    return buf;
+}
+#endif
+
+static const char *findchar_none(const char *buf, const char *buf_end, const struct findchar_set *set, int *found)
+{
+    *found = 0;
     /* suppress unused parameter warning */
     (void)buf_end;
-    (void)ranges;
-    (void)ranges_size;
-#endif
+    (void)set;
     return buf;
 }
 
+#if FINDCHAR_DISPATCH
+static const char *(*findchar_fast)(const char *, const char *, const struct findchar_set *, int *) = findchar_none;
+static int findchar_vector;
+
+/*
+ * Group the high nibbles by the set of low nibbles they accept; each
+ * group gets a bit, set in its high nibbles and in its low nibbles.
+ * Returns -1 if a set needs more than 8 groups.
+ */
+static int findchar_nibbles(struct findchar_set *set)
+{
+    unsigned short accept[16] = {0}, group[8];
+    int c, i, j, ngroups = 0;
+
+    for (i = 0; i < set->ranges_size; i += 2)
+        for (c = (unsigned char)set->ranges[i]; c <= (unsigned char)set->ranges[i + 1]; ++c)
+            accept[c >> 4] |= 1 << (c & 15);
+    memset(set->lo_nibble, 0, sizeof(set->lo_nibble));
+    memset(set->hi_nibble, 0, sizeof(set->hi_nibble));
+    for (i = 0; i < 16; ++i) {
+        if (accept[i] == 0)
+            continue;
+        for (j = 0; j < ngroups && group[j] != accept[i]; ++j)
+            ;
+        if (j == ngroups) {
+            if (ngroups == 8)
+                return -1;
+            group[ngroups++] = accept[i];
+            for (c = 0; c < 16; ++c)
+                if (accept[i] & (1 << c))
+                    set->lo_nibble[c] |= 1 << j;
+        }
+        set->hi_nibble[i] = 1 << j;
+    }
+    return 0;
+}
+
+__attribute__((constructor)) static void findchar_select(void)
+{
+    int nibbles = findchar_nibbles(&token_set) == 0 && findchar_nibbles(&eol_set) == 0 &&
+                  findchar_nibbles(&header_name_set) == 0;
+
+    __builtin_cpu_init();
+    if (nibbles && __builtin_cpu_supports("avx512bw"))
+        findchar_fast = findchar_avx512;
+    else if (nibbles && __builtin_cpu_supports("avx2"))
+        findchar_fast = findchar_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        findchar_fast = findchar_sse42;
+    findchar_vector = findchar_fast != findchar_none;
+}
+#elif __SSE4_2__
+#define findchar_fast findchar_sse42
+#define findchar_vector 1
+#else
+#define findchar_fast findchar_none
+#define findchar_vector 0
+#endif
+
 static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
 {
     const char *token_start = buf;
 
-#ifdef __SSE4_2__
-    static const char ranges1[] = "\0\010"
-                                  /* allow HT */
-                                  "\012\037"
-                                  /* allow SP and up to but not including DEL */
-                                  "\177\177"
-        /* allow chars w. MSB set */
-        ;
     int found;
-    buf = findchar_fast(buf, buf_end, ranges1, sizeof(ranges1) - 1, &found);
-    if (found)
-        goto FOUND_CTL;
-#else
-    /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
-    while (likely(buf_end - buf >= 8)) {
+    if (findchar_vector) {
+        buf = findchar_fast(buf, buf_end, &eol_set, &found);
+        if (found)
+            goto FOUND_CTL;
+    } else {
+        /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
+        while (likely(buf_end - buf >= 8)) {
 #define DOIT()                                                                                                                     \
     do {                                                                                                                           \
         if (unlikely(!IS_PRINTABLE_ASCII(*buf)))                                                                                   \
             goto NonPrintable;                                                                                                     \
         ++buf;                                                                                                                     \
     } while (0)
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
+            DOIT();
 #undef DOIT
-        continue;
-    NonPrintable:
-        if ((likely((unsigned char)*buf < '\040') && likely(*buf != '\011')) || unlikely(*buf == '\177')) {
-            goto FOUND_CTL;
+            continue;
+        NonPrintable:
+            if ((likely((unsigned char)*buf < '\040') && likely(*buf != '\011')) || unlikely(*buf == '\177')) {
+                goto FOUND_CTL;
+            }
+            ++buf;
         }
-        ++buf;
     }
-#endif
     for (;; ++buf) {
         CHECK_EOF();
         if (unlikely(!IS_PRINTABLE_ASCII(*buf))) {
@@ -287,16 +446,8 @@ static const char *parse_headers(const char *buf, const char *buf_end, struct ph
             /* parsing name, but do not discard SP before colon, see
              * http://www.mozilla.org/security/announce/2006/mfsa2006-33.html */
             headers[*num_headers].name = buf;
-            static const char ALIGNED(16) ranges1[] = "\x00 "  /* control chars and up to SP */
-                                                      "\"\""   /* 0x22 */
-                                                      "()"     /* 0x28,0x29 */
-                                                      ",,"     /* 0x2c */
-                                                      "//"     /* 0x2f */
-                                                      ":@"     /* 0x3a-0x40 */
-                                                      "[]"     /* 0x5b-0x5d */
-                                                      "{\377"; /* 0x7b-0xff */
             int found;
-            buf = findchar_fast(buf, buf_end, ranges1, sizeof(ranges1) - 1, &found);
+            buf = findchar_fast(buf, buf_end, &header_name_set, &found);
             if (!found) {
                 CHECK_EOF();
             }
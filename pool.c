@@ -0,0 +1,204 @@
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct pool_queue {
+	pthread_mutex_t lock;
+	struct pool_job *head;
+	struct pool_job *tail;
+} __attribute__((aligned(64)));
+
+struct pool {
+	struct pool_queue *queues;	/* one per thread */
+	int nthreads;
+	unsigned int next;		/* queue for the next submission */
+
+	/* idle threads sleep here until something is queued anywhere */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int queued;		/* jobs on all queues */
+};
+
+struct pool_thread {
+	struct pool *pool;
+	int id;
+};
+
+static struct pool_job *
+pool_dequeue(struct pool_queue *q, unsigned int *queued)
+{
+	struct pool_job *job;
+
+	pthread_mutex_lock(&q->lock);
+	if ((job = q->head) != NULL) {
+		if ((q->head = job->next) == NULL)
+			q->tail = NULL;
+		__atomic_sub_fetch(queued, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+/* the oldest job on our own queue, else the oldest one on another's */
+static struct pool_job *
+pool_take(struct pool *p, int id)
+{
+	struct pool_job *job;
+	int i;
+
+	for (i = 0; i < p->nthreads; i++) {
+		if ((job = pool_dequeue(&p->queues[(id + i) % p->nthreads],
+		    &p->queued)) != NULL)
+			return job;
+	}
+	return NULL;
+}
+
+/* hand a finished job back; only the first one after a drain wakes it */
+static void
+pool_post(struct pool_job *job)
+{
+	struct pool_cq *cq = job->cq;
+	struct pool_job *head;
+	uint64_t one = 1;
+
+	head = __atomic_load_n(&cq->done, __ATOMIC_RELAXED);
+	do {
+		job->next = head;
+	} while (!__atomic_compare_exchange_n(&cq->done, &head, job, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* the job is the drainer's now; only look at what it replaced */
+	if (head == NULL)
+		while (write(cq->efd, &one, sizeof(one)) == -1 && errno == EINTR)
+			; /* empty */
+}
+
+static void *
+pool_main(void *arg)
+{
+	struct pool_thread *t = arg;
+	struct pool *p = t->pool;
+	struct pool_job *job;
+	struct pool_cq *cq;
+
+	for (;;) {
+		if ((job = pool_take(p, t->id)) != NULL) {
+			cq = job->cq;
+			job->run(job);
+			if (cq != NULL)
+				pool_post(job);
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		while (__atomic_load_n(&p->queued, __ATOMIC_RELAXED) == 0)
+			pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Start `nthreads' threads that live as long as the process. They
+ * block every signal, which is left to the threads that create them.
+ */
+struct pool *
+pool_create(int nthreads)
+{
+	struct pool *p;
+	struct pool_thread *t;
+	sigset_t all, old;
+	pthread_t tid;
+	int i, error = 0;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	if ((p->queues = calloc(nthreads, sizeof(*p->queues))) == NULL ||
+	    (t = calloc(nthreads, sizeof(*t))) == NULL) {
+		free(p->queues);
+		free(p);
+		return NULL;
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_init(&p->queues[i].lock, NULL);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->nthreads = nthreads;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < nthreads && error == 0; i++) {
+		t[i].pool = p;
+		t[i].id = i;
+		if ((error = pthread_create(&tid, NULL, pool_main, &t[i])) == 0)
+			pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* fewer threads than queues still drain them all */
+	if (error != 0 && i == 1) {
+		free(t);
+		free(p->queues);
+		free(p);
+		errno = error;
+		return NULL;
+	}
+	return p;
+}
+
+void
+pool_submit(struct pool *p, struct pool_job *job)
+{
+	struct pool_queue *q;
+
+	q = &p->queues[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) %
+	    p->nthreads];
+	job->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != NULL)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+	__atomic_add_fetch(&p->queued, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&p->lock);
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int
+pool_cq_init(struct pool_cq *cq)
+{
+	cq->done = NULL;
+	if ((cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return -1;
+	return 0;
+}
+
+/* call `cb' with every finished job, oldest first, once its eventfd fires */
+void
+pool_cq_drain(struct pool_cq *cq, pool_cb cb, void *arg)
+{
+	struct pool_job *job, *next, *done = NULL;
+	uint64_t n;
+
+	while (read(cq->efd, &n, sizeof(n)) == -1 && errno == EINTR)
+		; /* empty */
+	job = __atomic_exchange_n(&cq->done, NULL, __ATOMIC_ACQUIRE);
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->next = done;
+		done = job;
+	}
+	for (job = done; job != NULL; job = next) {
+		next = job->next;
+		cb(job, arg);
+	}
+}
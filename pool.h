@@ -0,0 +1,41 @@
+#ifndef pool_h
+#define pool_h
+
+#include <pthread.h>
+
+/*
+ * Threads for work that may block, such as opening and reading files
+ * that are not in the page cache. Each thread has its own queue;
+ * submissions go to the queues in turn, and a thread with nothing to
+ * do takes work from another thread's queue. A finished job is posted
+ * to the completion queue it was submitted with, whose eventfd wakes
+ * the submitting event loop.
+ */
+struct pool;
+struct pool_job;
+
+/* one per event loop that submits jobs; only that loop drains it */
+struct pool_cq {
+	struct pool_job *done;		/* finished, newest first */
+	int efd;
+};
+
+/*
+ * Embed as the first member of a larger job. `run' is called on a pool
+ * thread; the job then belongs to its completion queue again or, if it
+ * has none, is gone: `run' must have disposed of it.
+ */
+struct pool_job {
+	struct pool_job *next;
+	struct pool_cq *cq;
+	void (*run)(struct pool_job *);
+};
+
+typedef void (*pool_cb)(struct pool_job *, void *arg);
+
+struct pool	*pool_create(int nthreads);
+void		 pool_submit(struct pool *, struct pool_job *);
+int		 pool_cq_init(struct pool_cq *);
+void		 pool_cq_drain(struct pool_cq *, pool_cb, void *arg);
+
+#endif
@@ -0,0 +1,134 @@
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/openat2.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "root.h"
+
+struct root_dir {
+	int used;
+	int root;
+	int fd;			/* O_PATH */
+	time_t expires;
+	uint64_t hash;
+	size_t len;
+	char path[ROOT_DIR_MAX];
+};
+
+/* direct-mapped by hash: a collision just replaces the older one */
+static __thread struct root_dir *dirs;
+
+static int no_openat2;
+
+static int
+root_beneath(int dirfd, const char *path, int flags)
+{
+	struct open_how how;
+	int fd;
+
+	if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+		memset(&how, 0, sizeof(how));
+		how.flags = flags | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+		if (fd != -1 || errno != ENOSYS)
+			return fd;
+		__atomic_store_n(&no_openat2, 1, __ATOMIC_RELAXED);
+	}
+	return openat(dirfd, path, flags | O_CLOEXEC);
+}
+
+/* hold the served directory open for the life of the process */
+int
+root_init(const char *path)
+{
+	return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+static uint64_t
+root_hash(int root, const char *dir, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ (unsigned int)root;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)dir[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* the first len bytes of rel, a directory beneath root, held open; or NULL */
+static struct root_dir *
+root_dir(int root, const char *dir, size_t len)
+{
+	struct root_dir *d;
+	uint64_t h;
+	time_t now;
+
+	if (len >= ROOT_DIR_MAX)
+		return NULL;
+	if (dirs == NULL && (dirs = calloc(ROOT_DIRS, sizeof(*dirs))) == NULL)
+		return NULL;
+	h = root_hash(root, dir, len);
+	d = &dirs[h % ROOT_DIRS];
+	now = time(NULL);
+	if (d->used && d->hash == h && d->root == root && d->len == len &&
+	    memcmp(d->path, dir, len) == 0 && now < d->expires)
+		return d;
+
+	if (d->used) {
+		close(d->fd);
+		d->used = 0;
+	}
+	memcpy(d->path, dir, len);
+	d->path[len] = '\0';
+	if ((d->fd = root_beneath(root, d->path, O_PATH | O_DIRECTORY)) == -1)
+		return NULL;
+	d->used = 1;
+	d->root = root;
+	d->hash = h;
+	d->len = len;
+	d->expires = now + ROOT_TTL;
+	return d;
+}
+
+/* open rel, a normalized path relative to root, for this thread */
+int
+root_open(int root, const char *rel, int flags)
+{
+	struct root_dir *d;
+	const char *base;
+
+	if ((base = strrchr(rel, '/')) == NULL ||
+	    (d = root_dir(root, rel, base - rel)) == NULL)
+		return root_beneath(root, rel, flags);
+	return root_beneath(d->fd, base + 1, flags);
+}
+
+/* what rel is, without opening it for reading */
+int
+root_stat(int root, const char *rel, struct stat *st)
+{
+	int fd, error;
+
+	if ((fd = root_open(root, rel, O_PATH)) == -1)
+		return -1;
+	if (fstat(fd, st) == -1) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef root_h
+#define root_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define ROOT_DIRS (64)		/* directories each thread keeps open */
+#define ROOT_DIR_MAX (256)	/* longer directory paths aren't kept */
+#define ROOT_TTL (10)		/* seconds a kept directory is trusted */
+
+/*
+ * Files beneath the served directory, opened by paths relative to it.
+ * openat2() resolves them with RESOLVE_BENEATH, so neither ".." nor a
+ * symlink leads out, and no magic link is followed. Each thread keeps
+ * O_PATH descriptors for the directories it opened files in recently,
+ * so a lookup walks only the file's own name. Kernels without openat2()
+ * get openat(), which leaves callers to keep ".." out of paths.
+ */
+int	root_init(const char *path);
+int	root_open(int root, const char *rel, int flags);
+int	root_stat(int root, const char *rel, struct stat *);
+
+#endif
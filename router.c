@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+struct rnode {
+	char *label;			/* literal segment, NULL for a parameter */
+	size_t len;
+	char *param;			/* the parameter's name */
+	struct rnode *children;		/* literal ones */
+	struct rnode *next;		/* sibling */
+	struct rnode *param_child;
+	struct route *exact;		/* patterns that end here */
+	struct route *rest;		/* patterns with a "*" here */
+};
+
+struct router {
+	struct rnode root;
+};
+
+struct router *
+router_create(void)
+{
+	return calloc(1, sizeof(struct router));
+}
+
+static struct rnode *
+rnode_literal(struct rnode *n, const char *seg, size_t len)
+{
+	struct rnode *c;
+
+	for (c = n->children; c != NULL; c = c->next)
+		if (c->len == len && memcmp(c->label, seg, len) == 0)
+			return c;
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	if ((c->label = strndup(seg, len)) == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->len = len;
+	c->next = n->children;
+	n->children = c;
+	return c;
+}
+
+static struct rnode *
+rnode_param(struct rnode *n, const char *name, size_t len)
+{
+	struct rnode *c;
+
+	/* one parameter child per node, whatever its routes call it */
+	if ((c = n->param_child) != NULL)
+		return c;
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	if ((c->param = strndup(name, len)) == NULL) {
+		free(c);
+		return NULL;
+	}
+	n->param_child = c;
+	return c;
+}
+
+/*
+ * Add a route for method (NULL for any) and a pattern such as "/",
+ * "/status" or "/files/:id/raw", or one that ends in a "*" segment.
+ * Routes with the same pattern are tried in the order they were added.
+ */
+int
+router_add(struct router *r, const char *method, const char *pattern,
+    route_handler handler, void *arg)
+{
+	struct rnode *n = &r->root;
+	struct route *rt, **tail;
+	const char *p, *seg;
+	size_t len;
+	int rest = 0, params = 0;
+
+	if (*pattern != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+	for (p = pattern + 1;; p = seg + len + 1) {
+		seg = p;
+		len = strcspn(seg, "/");
+		if (len == 1 && *seg == '*' && seg[1] == '\0') {
+			rest = 1;
+			break;
+		}
+		if (*seg == ':') {
+			if (len == 1 || ++params >= ROUTE_PARAMS_MAX) {
+				errno = EINVAL;
+				return -1;
+			}
+			n = rnode_param(n, seg + 1, len - 1);
+		} else
+			n = rnode_literal(n, seg, len);
+		if (n == NULL)
+			return -1;
+		if (seg[len] == '\0')
+			break;
+	}
+
+	if ((rt = calloc(1, sizeof(*rt))) == NULL)
+		return -1;
+	rt->method = method;
+	rt->handler = handler;
+	rt->arg = arg;
+	for (tail = rest ? &n->rest : &n->exact; *tail != NULL;
+	    tail = &(*tail)->next)
+		; /* empty */
+	*tail = rt;
+	return 0;
+}
+
+static const struct route *
+route_method(const struct route *rt, const char *method, size_t methodlen,
+    int *path_found)
+{
+	if (rt != NULL)
+		*path_found = 1;
+	for (; rt != NULL; rt = rt->next)
+		if (rt->method == NULL || (strlen(rt->method) == methodlen &&
+		    memcmp(rt->method, method, methodlen) == 0))
+			return rt;
+	return NULL;
+}
+
+/* match the segments from p on; `done' if there are none left */
+static const struct route *
+rnode_match(const struct rnode *n, const char *p, const char *end, int done,
+    const char *method, size_t methodlen, struct route_params *rp,
+    int *path_found)
+{
+	const struct route *rt;
+	const struct rnode *c;
+	const char *slash;
+	size_t len;
+
+	if (done) {
+		if ((rt = route_method(n->exact, method, methodlen,
+		    path_found)) != NULL)
+			return rt;
+	} else {
+		if ((slash = memchr(p, '/', end - p)) == NULL)
+			slash = end;
+		len = slash - p;
+		for (c = n->children; c != NULL; c = c->next) {
+			if (c->len != len || memcmp(c->label, p, len) != 0)
+				continue;
+			if ((rt = rnode_match(c, slash + 1, end, slash == end,
+			    method, methodlen, rp, path_found)) != NULL)
+				return rt;
+			break;
+		}
+		if ((c = n->param_child) != NULL && rp->n < ROUTE_PARAMS_MAX) {
+			rp->p[rp->n].name = c->param;
+			rp->p[rp->n].value = p;
+			rp->p[rp->n].len = len;
+			rp->n++;
+			if ((rt = rnode_match(c, slash + 1, end, slash == end,
+			    method, methodlen, rp, path_found)) != NULL)
+				return rt;
+			rp->n--;
+		}
+	}
+	if (n->rest != NULL && rp->n < ROUTE_PARAMS_MAX) {
+		rp->p[rp->n].name = "*";
+		rp->p[rp->n].value = done ? end : p;
+		rp->p[rp->n].len = done ? 0 : (size_t)(end - p);
+		rp->n++;
+		if ((rt = route_method(n->rest, method, methodlen,
+		    path_found)) != NULL)
+			return rt;
+		rp->n--;
+	}
+	return NULL;
+}
+
+/* add the methods of routes to a list, each once */
+static void
+route_allow(const struct route *rt, char *buf, size_t len)
+{
+	const char *p;
+	size_t n, mlen;
+
+	for (; rt != NULL; rt = rt->next) {
+		if (rt->method == NULL)
+			continue;
+		mlen = strlen(rt->method);
+		for (p = buf; *p != '\0'; p += n + (p[n] == ',' ? 2 : 0)) {
+			n = strcspn(p, ",");
+			if (n == mlen && memcmp(p, rt->method, n) == 0)
+				break;
+		}
+		if (*p != '\0')
+			continue;
+		n = strlen(buf);
+		snprintf(buf + n, len - n, "%s%s", n > 0 ? ", " : "", rt->method);
+	}
+}
+
+/* like rnode_match(), collecting the methods of every route that fits */
+static void
+rnode_allow(const struct rnode *n, const char *p, const char *end, int done,
+    char *buf, size_t len)
+{
+	const struct rnode *c;
+	const char *slash;
+	size_t seglen;
+
+	if (done)
+		route_allow(n->exact, buf, len);
+	else {
+		if ((slash = memchr(p, '/', end - p)) == NULL)
+			slash = end;
+		seglen = slash - p;
+		for (c = n->children; c != NULL; c = c->next)
+			if (c->len == seglen && memcmp(c->label, p, seglen) == 0)
+				rnode_allow(c, slash + 1, end, slash == end, buf,
+				    len);
+		if (n->param_child != NULL)
+			rnode_allow(n->param_child, slash + 1, end,
+			    slash == end, buf, len);
+	}
+	route_allow(n->rest, buf, len);
+}
+
+/*
+ * The methods the routes for path take, as a comma-separated list for
+ * the Allow header of a 405; empty if there are none.
+ */
+void
+router_allow(struct router *r, const char *path, size_t pathlen, char *buf,
+    size_t len)
+{
+	const char *end;
+
+	buf[0] = '\0';
+	if (pathlen == 0 || *path != '/')
+		return;
+	if ((end = memchr(path, '?', pathlen)) == NULL)
+		end = path + pathlen;
+	rnode_allow(&r->root, path + 1, end, 0, buf, len);
+}
+
+/*
+ * The route for a request, with what its parameters matched; NULL if
+ * there is none. *path_found tells a path no route has (404) from a
+ * method the path's routes don't take (405).
+ */
+const struct route *
+router_match(struct router *r, const char *method, size_t methodlen,
+    const char *path, size_t pathlen, struct route_params *rp,
+    int *path_found)
+{
+	const char *end;
+
+	rp->n = 0;
+	*path_found = 0;
+	if (pathlen == 0 || *path != '/')
+		return NULL;
+	if ((end = memchr(path, '?', pathlen)) == NULL)
+		end = path + pathlen;
+	return rnode_match(&r->root, path + 1, end, 0, method, methodlen, rp,
+	    path_found);
+}
@@ -0,0 +1,51 @@
+#ifndef router_h
+#define router_h
+
+#include <stddef.h>
+
+#define ROUTE_PARAMS_MAX (8)
+
+struct request;
+
+/* what a route's ":name" and "*" segments matched, in the request's path */
+struct route_params {
+	int n;
+	struct {
+		const char *name;	/* "*" for the rest of the path */
+		const char *value;
+		size_t len;
+	} p[ROUTE_PARAMS_MAX];
+};
+
+typedef void (*route_handler)(struct request *, const struct route_params *,
+    void *arg);
+
+struct route {
+	const char *method;	/* NULL for any */
+	route_handler handler;
+	void *arg;
+	struct route *next;	/* same pattern, another method */
+};
+
+/*
+ * Dispatch on method and path. Patterns are compiled into a trie of
+ * path segments; each segment is literal, a ":name" parameter that
+ * matches any one segment, or a final "*" that matches the rest of
+ * the path, nothing included. A literal segment wins over a parameter
+ * and both over a "*", backing off when what follows doesn't match.
+ * Matching stops at a query, allocates nothing and returns values that
+ * point into the path. Add every route before the workers start; the
+ * router is read-only after that.
+ */
+struct router;
+
+struct router		*router_create(void);
+int			 router_add(struct router *, const char *method,
+			    const char *pattern, route_handler, void *arg);
+const struct route	*router_match(struct router *, const char *method,
+			    size_t methodlen, const char *path, size_t pathlen,
+			    struct route_params *, int *path_found);
+void			 router_allow(struct router *, const char *path,
+			    size_t pathlen, char *buf, size_t len);
+
+#endif
@@ -1,48 +1,251 @@
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+#include <linux/filter.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <signal.h>
 
 #include "picohttpparser.h"
+#include "cache.h"
+#include "fdcache.h"
 #include "http.h"
+#include "log.h"
+#include "mime.h"
+#include "pool.h"
+#include "root.h"
+#include "router.h"
+#include "slab.h"
+#include "timer.h"
+#include "upstream.h"
+#include "uring.h"
+#include "zcache.h"
 
 #define PORT_NO (8080)
 #define SRV_ROOT ("/var/www/html")
+#define INDEX_FILE ("index.html")	/* served for a directory */
+#define STATUS_PATH ("/server-status")
 #define LOG_PATH ("test/server_test.log")
-#define NWORKERS (4)
+#define NWORKERS (4)		/* processes; threads default to one per CPU */
+#define IDLE_TIMEOUT (3)		/* keep-alive, seconds */
+#define HEADER_TIMEOUT (10)		/* for a whole head, from its first byte */
+#define BODY_TIMEOUT (10)		/* between reads of a request body */
+#define WRITE_TIMEOUT (10)		/* between writes while output waits */
+#define BUF_INITIAL (4096)
+#define MAX_HEADER_SIZE (64 * 1024)
+#define MAX_BODY_SIZE (1024 * 1024)
+#define OUT_HIGHWAT (256 * 1024)
+#define OUTBUF_SIZE (4096)
+#define OUT_IOVMAX (16)
+#define ACCEPT_BATCH (64)
+#define ACCEPT_PAUSE (1)
+#define STATS_INTERVAL (10)
+#define CACHE_SIZE (64 * 1024 * 1024)
+#define ZCACHE_SIZE (16 * 1024 * 1024)
+#define ZCACHE_THREADS (1)	/* per process, compressing variants */
+#define RESPONSE_HEAD_MAX (1024)
+#define RESPONSE_IOVMAX (8)
+#define REQBUF_POOL (64)	/* idle parse buffers kept per worker */
+#define RANGES_MAX (16)	/* more byte ranges than this get the whole file */
+#define ETAG_MAX (64)		/* ours are three hex numbers, quoted */
+#define NONE_MATCH_MAX (512)	/* longer If-None-Match lists are ignored */
+#define URING_ENTRIES (512)
+#define URING_BUFS (256)	/* receive buffers of BUF_INITIAL bytes */
+#define URING_FILES (65536)	/* fixed file slots, one per fd number */
+#define URING_PIPE_SIZE (1024 * 1024)
+#define DISK_THREADS (4)	/* per process, for opening uncached files */
+#define UPSTREAM_HEAD_MAX (16 * 1024)	/* and the buffer bodies pass through */
+#define UPSTREAM_IDLE_MAX (16)	/* kept-alive connections per backend */
+#define UPSTREAM_TIMEOUT (30)	/* between reads and writes of a backend */
+#define UPSTREAM_IDLE_TIMEOUT (4)	/* kept unused; below the usual backend's */
 
 #define MINIMUM(a, b) (a < b ? a : b)
 
 // TODO: parse config with yacc
-// TODO: use worker processes to distribute workload
-// TODO: dispatch on filepath
 // TODO: configure for TLS
-// TODO: set response headers and serialize automatically
 
-pid_t workers[NWORKERS];
+pid_t *workers;		/* NULL when workers are threads */
+
+/* deadlines a connection can be waiting on */
+enum {
+	TIMEOUT_NONE,
+	TIMEOUT_IDLE,
+	TIMEOUT_HEADER,
+	TIMEOUT_BODY,
+	TIMEOUT_WRITE,
+	TIMEOUT_UPSTREAM,
+};
+
+/* this worker's connections; events refer to them by handle */
+__thread struct slab *requests;
+
+/* what drives a worker's connections */
+enum {
+	ENGINE_LIBEVENT,	/* readiness callbacks, plain system calls */
+	ENGINE_URING,		/* io_uring submissions and completions */
+};
+
+/*
+ * io_uring operations, carried in the user data of each submission
+ * next to the connection's slab handle. The handle's slot index never
+ * gets near bit URING_OP_SHIFT: there are not that many descriptors.
+ */
+#define URING_OP_SHIFT (28)
+#define URING_OP_MASK ((uint64_t)0xf << URING_OP_SHIFT)
+
+enum {
+	URING_ACCEPT,		/* multishot, no connection yet */
+	URING_RECV,		/* multishot, into the buffer ring */
+	URING_SEND,		/* a run of memory buffers */
+	URING_SPLICE_IN,	/* file to pipe, linked to the next two */
+	URING_POLL,		/* wait for room in the socket */
+	URING_SPLICE_OUT,	/* pipe to socket */
+	URING_CANCEL,
+	URING_UPDATE,		/* fixed file slot */
+};
+
+/* what a submission points to, kept until it is submitted */
+struct uring_arg {
+	struct msghdr msg;
+	struct iovec iov[OUT_IOVMAX];
+	int fd;
+};
+
+/* how workers share incoming connections */
+enum {
+	LISTEN_SHARED,		/* one socket, every worker woken */
+	LISTEN_REUSEPORT,	/* a SO_REUSEPORT socket per worker */
+	LISTEN_EXCLUSIVE,	/* one socket, EPOLLEXCLUSIVE wakeups */
+};
+
+struct accept_stats {
+	unsigned long long accepted;
+	unsigned long long accept_full;	/* batches that hit ACCEPT_BATCH */
+	unsigned long long accept_errors;
+	unsigned int queue_max;		/* deepest accept queue seen */
+	unsigned long long reported;
+
+	/* master only: kernel-wide listen queue overflow counters */
+	unsigned long long overflows;
+	unsigned long long drops;
+	uint64_t cache_lookups;
+	uint64_t fdcache_lookups;
+	uint64_t zcache_lookups;
+
+	/* files opened on the disk pool */
+	unsigned long long offloaded;
+	unsigned long long offloaded_reported;
+
+	/* requests passed on to backends */
+	unsigned long long proxied;
+	unsigned long long proxied_reported;
+};
 
 struct server {
+	struct event_base *base;	/* this worker's own */
 	struct event ev;
+	struct event pause_ev;
+	struct event stats_ev;
+	struct event notify_ev;
+	struct event sigterm;
+	struct accept_stats stats;
+	int is_master;
+	int id;			/* worker index */
+	int nworkers;
+	int threaded;		/* workers are threads of one process */
+
+	int fd;			/* this worker's listening socket */
+	int efd;		/* private epoll set for LISTEN_EXCLUSIVE */
+	int listen_mode;
+	int steer;		/* pin workers, steer connections by CPU */
+	int backlog;
 
 	int port;
+	struct router *router;	/* shared, read-only once workers start */
+	struct upstream *upstreams;	/* proxied prefixes, shared likewise */
+	int nupstreams;
+	struct proxy_pool *proxies;	/* this worker's, one per upstream */
 	char root[PATH_MAX];
+	int root_fd;		/* O_PATH, every file is opened beneath it */
+
+	/* largest request head (431) and body (413) we accept */
+	size_t max_header_size;
+	size_t max_body_size;
+
+	/* stop reading a client once this much output is queued for it */
+	size_t out_highwat;
+
+	/* hot-file cache shared with the other processes, or NULL */
+	struct cache *cache;
+	size_t cache_size;
+
+	/* this worker's open files and failed lookups, or NULL */
+	struct fdcache *fdcache;
 
-	FILE *log_file;
+	/* compressed variants and the threads making them, or NULL */
+	struct zcache *zcache;
+	size_t zcache_size;
+	struct pool *zpool;
+
+	/*
+	 * Threads that open files the fd cache doesn't know, shared by
+	 * the workers of one process, or NULL to open them inline.
+	 */
+	struct pool *pool;
+	int disk_threads;
+	struct pool_cq diskq;	/* this worker's finished opens */
+	struct event disk_ev;
+
+	int engine;
+
+	/* ENGINE_URING: the ring and what is registered with it */
+	struct uring ring;
+	struct uring_bufs rbufs;
+	struct uring_arg *args;	/* one per submission entry */
+	unsigned int nfiles;	/* fixed file slots, 0 if none */
+	struct event ring_ev;
+
+	/* connection deadlines, advanced after every loop iteration */
+	struct wheel timers;
+	struct event tick_ev;	/* wakes the loop for them */
+	uint64_t tick_next;	/* the tick it is armed for, 0 if none */
+
+	/* parse buffers not lent to a connection */
+	SLIST_HEAD(, reqbuf) reqbufs;
+	size_t nreqbufs;
+
+	/* memory held for connections beyond their slab slots */
+	size_t in_mem;		/* parse buffers, lent and pooled */
+	size_t out_mem;		/* output queues */
+
+	int log_fd;
+	int log_level;
 	char log_path[PATH_MAX];
 
 	char name[64];
@@ -51,41 +254,227 @@ struct server {
 struct client {
 	int fd;
 	struct sockaddr_in addr;
-	struct bufferevent *bev;
 	struct server *srv;
 	struct event ev;
 };
 
-struct request {
-	int is_closed;
+/*
+ * A pending piece of output: either bytes copied into `data' or a
+ * range of an open file, sent with sendfile(2) or splice(2).
+ */
+struct outbuf {
+	TAILQ_ENTRY(outbuf) entry;
 
-	struct client cli;
+	int fd;			/* -1 for in-memory data */
+	off_t off;		/* next byte to send, in data or the file */
+	off_t end;
+	size_t cap;
+	int use_splice;
+
+	char data[];
+};
+TAILQ_HEAD(outq, outbuf);
+
+/*
+ * Input and parse state, lent to a connection from the worker's pool
+ * only while it has unprocessed bytes; an idle keep-alive connection
+ * holds none.
+ */
+struct reqbuf {
+	SLIST_ENTRY(reqbuf) entry;	/* pool freelist */
+
+	/*
+	 * Input buffer, grown on demand; may hold several pipelined
+	 * requests. `parsed' is how much of it the parser has already
+	 * seen without finding the end of the head.
+	 */
+	char *buf;
+	size_t bufsize;
+	size_t buflen;
+	size_t parsed;
+	int body;		/* the head is in, waiting for the body */
+	size_t reqlen;		/* ... until this much is buffered */
 
 	size_t methodlen;
 	const char *method;
 
 	size_t pathlen;
 	const char *path;
+	/* path normalized for routing; valid while its handler runs */
+	size_t targetlen;
+	const char *target;
 
-	int minor_version;
+	/* the body, which is always read whole before the request is handled */
+	const char *content;
+	size_t contentlen;
 
 	size_t nheaders;
+	/* the first of each known header, NULL if the request has none */
+	struct phr_header *known[HDR_UNKNOWN];
 	struct phr_header headers[100];
 };
 
+/*
+ * The byte ranges a request asks for, in its order. As parsed, `first'
+ * is -1 for the last `last' bytes and `last' is -1 for everything from
+ * `first' on; ranges_resolve() turns them into inclusive offsets.
+ */
+struct byterange {
+	off_t first;
+	off_t last;
+};
+
+struct ranges {
+	int n;			/* 0 for the whole file */
+	time_t if_range;	/* unless modified since, -1 if none */
+	char if_tag[ETAG_MAX];	/* unless the ETag differs, "" if none */
+	struct byterange r[RANGES_MAX];
+};
+
+/*
+ * What a GET's answer depends on, copied out of its head: the file is
+ * sent only if none of the entity tags matches or, without any, if it
+ * changed since the date.
+ */
+struct preconds {
+	time_t modified_since;	/* -1 if none */
+	char none_match[NONE_MATCH_MAX];	/* "" if none */
+};
+
+/* each content coding's name and the suffix of its sidecar file */
+const struct {
+	const char *name;
+	const char *suffix;
+} encodings[ENC_MAX] = {
+	[ENC_BR] = { "br", ".br" },
+	[ENC_GZIP] = { "gzip", ".gz" },
+	[ENC_IDENTITY] = { "identity", "" },
+};
+
+/*
+ * A file request, copied out of the head because the parse buffer is
+ * reused before a lookup on the disk pool returns. The variant at hand
+ * is the file itself or its `enc' sidecar; `made' is the coding we
+ * applied to it ourselves, which sets the ETag apart.
+ */
+struct fetch {
+	char path[PATH_MAX];	/* without any sidecar suffix */
+	size_t rel;		/* where the part below the root starts */
+	const char *type;	/* the path's, whatever variant is sent */
+	int encs;		/* 1 << ENC_* for each coding the client takes */
+	int enc;
+	int made;
+	struct ranges ranges;
+	struct preconds preconds;
+};
+
+struct request {
+	int is_closed;
+	short evwhat;
+	int keepalive;
+	int closing;		/* answer what is queued, then close */
+	int linger;		/* drain input before closing */
+	int draining;
+	int eof;
+	int minor_version;
+	int head;		/* HEAD: the response goes without its body */
+
+	struct reqbuf *in;	/* NULL while idle */
+
+	/* the deadline that applies to what the connection is doing */
+	struct timer timer;
+	int timeout;
+	int progress;		/* bytes moved since the deadline was set */
+
+	/* responses waiting for the socket, drained on EV_WRITE */
+	struct outq outq;
+	size_t outlen;		/* bytes queued, file ranges included */
+
+	/* splice(2) fallback when sendfile(2) can't handle a file */
+	int pipe[2];
+	size_t pipelen;
+	size_t pipesize;
+
+	/* ENGINE_URING: operations the kernel still holds */
+	int inflight;		/* completions still to come */
+	int reading;		/* multishot receive armed */
+	int unreading;		/* ... and being cancelled */
+	int sending;		/* completions of the send in progress */
+	int fixed;		/* fd is registered in the slot of its number */
+
+	int waiting;		/* for the disk pool to open a file */
+	struct upconn *upstream;	/* or a backend to answer, or NULL */
+
+	struct client cli;
+};
+
+/* what a backend connection is doing */
+enum {
+	UPCONN_IDLE,		/* pooled, no request */
+	UPCONN_SENDING,		/* the request */
+	UPCONN_HEAD,		/* waiting for the response head */
+	UPCONN_BODY,
+};
+
+/* how a response body ends */
+enum {
+	BODY_NONE,
+	BODY_LENGTH,		/* after Content-Length bytes */
+	BODY_CHUNKED,		/* with the last chunk */
+	BODY_CLOSE,		/* when the backend closes the connection */
+};
+
+/*
+ * A worker's connection to a backend, carrying one request at a time
+ * and kept alive between them. The response passes through `buf' on
+ * its way to the client's output queue.
+ */
+struct upconn {
+	SLIST_ENTRY(upconn) entry;	/* idle list */
+	struct server *srv;
+	const struct upstream *up;
+	int backend;
+	int fd;
+	struct event ev;
+	short evwhat;		/* what ev is armed for */
+	struct timer timer;	/* on the worker's wheel, like the clients' */
+	int state;
+	int reused;		/* it came from the pool */
+	int idempotent;		/* so it can be sent again */
+
+	struct request *req;
+	char *out;		/* the request as the backend gets it */
+	size_t outlen;
+	size_t outoff;
+
+	char buf[UPSTREAM_HEAD_MAX];
+	size_t buflen;
+	int received;		/* the backend sent anything at all */
+	int replied;		/* the response head went to the client */
+	int framing;
+	unsigned long long remaining;	/* BODY_LENGTH */
+	struct phr_chunked_decoder dec;	/* BODY_CHUNKED */
+	int rechunk;		/* the client gets the body chunked */
+	int keepalive;		/* the backend takes another request after */
+	int paused;		/* until the client's queue drains */
+};
+
+/* one worker's connections to an upstream group's backends */
+struct proxy_pool {
+	struct upstream_load load;
+	SLIST_HEAD(, upconn) idle[UPSTREAM_BACKENDS_MAX];
+	int nidle[UPSTREAM_BACKENDS_MAX];
+};
+
 void
 server_log(struct server *srv, const char *fmt, ...)
 {
 	va_list ap;
 
-	fprintf(srv->log_file, "[%s] ", srv->name);
+	(void)srv;
 	va_start(ap, fmt);
-
-	vfprintf(srv->log_file, fmt, ap);
-	fflush(stderr);
-	
+	log_vmsg(LVL_INFO, fmt, ap);
 	va_end(ap);
-	fprintf(srv->log_file, "\n");
 }
 
 void
@@ -93,280 +482,4472 @@ setnonblock(int fd)
 {
   int flags = fcntl(fd, F_GETFL, 0);
 
-  fcntl(fd, F_SETFL, flags & O_NONBLOCK);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+/* event_set() on the worker's own base, not libevent's global one */
 void
-request_close(struct request *req)
+server_event_set(struct server *srv, struct event *ev, int fd, short what,
+    void (*cb)(int, short, void *), void *arg)
 {
-	if (!req->is_closed) {
-	    event_del(&req->cli.ev);
-	    close(req->cli.fd);
-	    free(req);
-	}
-	req->is_closed = 1;
+	event_set(ev, fd, what, cb, arg);
+	event_base_set(srv->base, ev);
+}
+
+void
+outbuf_free(struct server *srv, struct outbuf *ob)
+{
+	if (ob->fd != -1)
+		close(ob->fd);
+	srv->out_mem -= sizeof(*ob) + ob->cap;
+	free(ob);
 }
 
+/* lend a parse buffer to a connection that is about to read */
 int
-request_write(struct request *req, char *buf, size_t len)
+request_borrow(struct request *req)
 {
-	ssize_t n;
+	struct server *srv = req->cli.srv;
+	struct reqbuf *in;
+
+	if ((in = SLIST_FIRST(&srv->reqbufs)) != NULL) {
+		SLIST_REMOVE_HEAD(&srv->reqbufs, entry);
+		srv->nreqbufs--;
+	} else {
+		if ((in = malloc(sizeof(*in))) == NULL)
+			return -1;
+		in->buf = NULL;
+		in->bufsize = 0;
+		srv->in_mem += sizeof(*in);
+	}
+	in->buflen = 0;
+	in->parsed = 0;
+	in->body = 0;
+	req->in = in;
+	return 0;
+}
 
-	server_log(req->cli.srv, "responding: %s (%d)\n", buf, (int)len);
+/* take back a parse buffer, keeping it for the next reader if it is small */
+void
+request_return(struct request *req)
+{
+	struct server *srv = req->cli.srv;
+	struct reqbuf *in = req->in;
 
-	if ((n = write(req->cli.fd, buf, len)) == -1) {
-		request_close(req);
-		return -1;
+	req->in = NULL;
+	if (in->bufsize > BUF_INITIAL || srv->nreqbufs == REQBUF_POOL) {
+		srv->in_mem -= in->bufsize;
+		free(in->buf);
+		in->buf = NULL;
+		in->bufsize = 0;
 	}
-	return n;
+	if (srv->nreqbufs == REQBUF_POOL) {
+		srv->in_mem -= sizeof(*in);
+		free(in);
+		return;
+	}
+	SLIST_INSERT_HEAD(&srv->reqbufs, in, entry);
+	srv->nreqbufs++;
 }
 
-int
-request_status(struct request *req, HTTP_STATUS status)
+void request_cancel(struct request *);
+void request_unfix(struct request *);
+int request_send(struct request *);
+int request_recv(struct request *, int);
+void client_event(int, short, void *);
+void client_run(struct request *);
+void request_ranges(struct request *, struct ranges *);
+void request_preconds(struct request *, struct preconds *);
+int request_encodings(struct request *);
+HTTP_HEADER header_lookup(const char *, size_t);
+int path_normalize(const char *, size_t, char *, size_t);
+int target_normalize(const char *, size_t, char *, size_t);
+const char *fetch_rel(struct fetch *, const char *);
+int fetch_compressible(struct server *, struct fetch *);
+int fetch_compressed(struct request *, struct fetch *, int, struct stat *);
+void client_timeout(void *);
+void client_reject(struct request *, HTTP_STATUS);
+void proxy_abandon(struct upconn *);
+
+void
+request_free(struct request *req)
 {
-	char status_line[256];
-	size_t n;
-	// currently assumes http/1.1
-	n = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %s\r\n", http_status_string[status]);
-	return request_write(req, status_line, n);
+	struct outbuf *ob;
+
+	while ((ob = TAILQ_FIRST(&req->outq)) != NULL) {
+		TAILQ_REMOVE(&req->outq, ob, entry);
+		outbuf_free(req->cli.srv, ob);
+	}
+	if (req->pipe[0] != -1) {
+		close(req->pipe[0]);
+		close(req->pipe[1]);
+	}
+	if (req->fixed)
+		request_unfix(req);
+	if (req->upstream != NULL)
+		proxy_abandon(req->upstream);
+	close(req->cli.fd);
+	if (req->in != NULL)
+		request_return(req);
+	slab_free(requests, req);
+}
+
+/*
+ * With io_uring, operations still in the kernel may point into the
+ * connection's buffers, so they are cancelled and the connection is
+ * freed by the last completion instead.
+ */
+void
+request_close(struct request *req)
+{
+	if (req->is_closed)
+		return;
+	/* mark before freeing; nothing may touch req afterwards */
+	req->is_closed = 1;
+	if (req->evwhat != 0 && req->cli.srv->engine == ENGINE_LIBEVENT)
+		event_del(&req->cli.ev);
+	timer_cancel(&req->cli.srv->timers, &req->timer);
+	if (req->inflight > 0) {
+		request_cancel(req);
+		return;
+	}
+	request_free(req);
 }
 
 void
 request_init(struct request *req)
 {
 	req->is_closed = 0;
+	req->evwhat = 0;
+	req->keepalive = 0;
+	req->closing = 0;
+	req->linger = 0;
+	req->draining = 0;
+	req->eof = 0;
+	req->minor_version = 1;
+	req->head = 0;
+	req->in = NULL;
+	timer_init(&req->timer, client_timeout, req);
+	req->timeout = TIMEOUT_NONE;
+	req->progress = 0;
+	TAILQ_INIT(&req->outq);
+	req->outlen = 0;
+	req->pipe[0] = -1;
+	req->pipe[1] = -1;
+	req->pipelen = 0;
+	req->pipesize = 0;
+	req->inflight = 0;
+	req->reading = 0;
+	req->unreading = 0;
+	req->sending = 0;
+	req->fixed = 0;
+	req->waiting = 0;
+	req->upstream = NULL;
 }
 
+/*
+ * Output could not be queued, so the response stream is already
+ * broken: drop everything and close once the handler returns.
+ */
 void
-transfer_file(struct request *req, int fd)
+request_abort(struct request *req)
 {
-	ssize_t n;
-	char buf[1024];
+	struct outbuf *ob;
 
-	char content_type[] = "Content-Type: text/html\r\n\r\n";
-
-	if (request_status(req, HTTP_200) == -1)
+	if (req->sending > 0) {
+		/* the kernel is still reading the head of the queue */
+		req->closing = 1;
+		request_close(req);
 		return;
+	}
+	while ((ob = TAILQ_FIRST(&req->outq)) != NULL) {
+		TAILQ_REMOVE(&req->outq, ob, entry);
+		outbuf_free(req->cli.srv, ob);
+	}
+	req->outlen = 0;
+	req->closing = 1;
+	req->linger = 0;
+}
 
-	if (request_write(req, content_type, sizeof(content_type)) == -1)
-		return;
+/*
+ * Make room for len bytes at the end of the queue, in the last memory
+ * buffer if it fits. Nothing is queued until request_commit().
+ */
+char *
+request_reserve(struct request *req, size_t len)
+{
+	struct outbuf *ob;
+	size_t cap;
 
-	while (1) {
-		n = read(fd, buf, sizeof(buf));
-		if (n == -1)
-		  break;
-		else if (n == 0) {
-		  close(fd);
-		  break;
-		} else
-		    request_write(req, buf, n);
+	ob = TAILQ_LAST(&req->outq, outq);
+	if (ob == NULL || ob->fd != -1 || ob->cap - (size_t)ob->end < len) {
+		cap = len > OUTBUF_SIZE ? len : OUTBUF_SIZE;
+		if ((ob = malloc(sizeof(*ob) + cap)) == NULL) {
+			request_abort(req);
+			return NULL;
+		}
+		ob->fd = -1;
+		ob->off = ob->end = 0;
+		ob->cap = cap;
+		ob->use_splice = 0;
+		TAILQ_INSERT_TAIL(&req->outq, ob, entry);
+		req->cli.srv->out_mem += sizeof(*ob) + cap;
 	}
+	return ob->data + ob->end;
 }
 
 void
-send_file(struct request *req, const char *filepath, size_t len)
+request_commit(struct request *req, size_t len)
 {
-	int fd;
-	char errormsg[1024];
-	size_t n;
-	char path[PATH_MAX];
+	struct outbuf *ob = TAILQ_LAST(&req->outq, outq);
 
-	snprintf(path, sizeof(path), "%s%.*s", req->cli.srv->root, (int)len, filepath);
+	ob->end += len;
+	req->outlen += len;
+}
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
-		n = snprintf(errormsg, sizeof(errormsg), "404: %s NOTFOUND\n", path);
-		write(req->cli.fd, errormsg, MINIMUM(n, sizeof(errormsg)));
-		return;
-	}
+/* queue len bytes of fd from off; the queue owns fd from here on */
+int
+request_sendfile(struct request *req, int fd, off_t off, off_t len)
+{
+	struct outbuf *ob;
 
-	transfer_file(req, fd);
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+	if ((ob = malloc(sizeof(*ob))) == NULL) {
+		close(fd);
+		request_abort(req);
+		return -1;
+	}
+	ob->fd = fd;
+	ob->off = off;
+	ob->end = off + len;
+	ob->cap = 0;
+	req->cli.srv->out_mem += sizeof(*ob);
+	ob->use_splice = 0;
+	TAILQ_INSERT_TAIL(&req->outq, ob, entry);
+	req->outlen += len;
+	return 0;
 }
 
-void
-client_read(int fd, short what, void *arg)
+/*
+ * Move file bytes to the socket through a pipe. Bytes already in the
+ * pipe are drained before more are pulled from the file, so a short
+ * write to the socket loses nothing.
+ */
+int
+outbuf_splice(struct request *req, struct outbuf *ob)
 {
-	struct request *req = arg;
-	struct server *srv = req->cli.srv;
+	ssize_t n;
 
-	char buf[4096];
-	size_t buflen = 0, prevbuflen = 0;
-	int ret;
-	unsigned i;
+	if (req->pipe[0] == -1 && pipe2(req->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		return -1;
 
-	if (what & EV_TIMEOUT) {
-		server_log(srv, "request timed out");
-		request_close(req);
-		close(fd);
+	while (req->pipelen > 0 || ob->off < ob->end) {
+		if (req->pipelen == 0) {
+			n = splice(ob->fd, &ob->off, req->pipe[1], NULL,
+			    ob->end - ob->off, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			req->pipelen = n;
+		}
+		n = splice(req->pipe[0], NULL, req->cli.fd, NULL, req->pipelen,
+		    SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		req->pipelen -= n;
+		req->outlen -= n;
+		req->progress = 1;
 	}
-	server_log(srv, "starting read");
+	return 1;
+}
 
-	while (1) {
-		while ((ret = read(fd, buf + buflen, sizeof(buf) - buflen)) == -1 && errno == EINTR)
-			; /* empty */
-		if (ret <= 0) {
-			return;
+/* send a file range; same return convention as request_flush() */
+int
+outbuf_sendfile(struct request *req, struct outbuf *ob)
+{
+	ssize_t n;
+
+	while (!ob->use_splice && ob->off < ob->end) {
+		n = sendfile(req->cli.fd, ob->fd, &ob->off, ob->end - ob->off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINVAL || errno == ENOSYS) {
+				ob->use_splice = 1;
+				break;
+			}
+			return -1;
 		}
-		prevbuflen = buflen;
-		buflen += ret;
+		if (n == 0)	/* file shrank underneath us */
+			return -1;
+		req->outlen -= n;
+		req->progress = 1;
+	}
 
-		req->nheaders = sizeof(req->headers) / sizeof(req->headers[0]);
-		ret = phr_parse_request(buf, buflen,
-					&req->method, &req->methodlen,
-					&req->path, &req->pathlen,
-					&req->minor_version,
-					req->headers, &req->nheaders, prevbuflen);
-		if (ret > 0)
-			break; /* done */
-		else if (ret == -1)
-			return;
+	if (ob->use_splice)
+		return outbuf_splice(req, ob);
+	return 1;
+}
 
-		assert(ret == -2);
-		if (buflen == sizeof(buf))
-			return;
+/*
+ * Write out as much of the output queue as the socket takes. Runs of
+ * memory buffers go out in one sendmsg(2); file ranges go through
+ * sendfile(2). Returns 1 once the queue is empty, 0 if the socket is
+ * full and the caller should wait for EV_WRITE, -1 on error.
+ */
+int
+request_flush(struct request *req)
+{
+	struct outbuf *ob, *next;
+	struct iovec iov[OUT_IOVMAX];
+	struct msghdr msg;
+	ssize_t n;
+	size_t len;
+	int iovcnt, ret;
+
+	if (req->cli.srv->engine == ENGINE_URING)
+		return request_send(req);
+	while ((ob = TAILQ_FIRST(&req->outq)) != NULL) {
+		if (ob->fd != -1) {
+			if ((ret = outbuf_sendfile(req, ob)) != 1)
+				return ret;
+			TAILQ_REMOVE(&req->outq, ob, entry);
+			outbuf_free(req->cli.srv, ob);
+			continue;
+		}
+
+		iovcnt = 0;
+		for (next = ob; next != NULL && next->fd == -1 &&
+		    iovcnt < OUT_IOVMAX; next = TAILQ_NEXT(next, entry)) {
+			iov[iovcnt].iov_base = next->data + next->off;
+			iov[iovcnt].iov_len = next->end - next->off;
+			iovcnt++;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		/* let headers share a segment with the file data that follows */
+		n = sendmsg(req->cli.fd, &msg,
+		    MSG_NOSIGNAL | (next != NULL ? MSG_MORE : 0));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		req->outlen -= n;
+		req->progress = 1;
+		while (n > 0) {
+			ob = TAILQ_FIRST(&req->outq);
+			len = ob->end - ob->off;
+			if ((size_t)n < len) {
+				ob->off += n;
+				break;
+			}
+			n -= len;
+			TAILQ_REMOVE(&req->outq, ob, entry);
+			outbuf_free(req->cli.srv, ob);
+		}
+	}
+	return 1;
+}
+
+/*
+ * A submission for one of req's operations, NULL if the ring is full
+ * even after submitting what is queued. The connection's socket is
+ * the target unless the caller says otherwise.
+ */
+struct io_uring_sqe *
+request_sqe(struct request *req, int op)
+{
+	struct server *srv = req->cli.srv;
+	struct io_uring_sqe *sqe;
 
+	if ((sqe = uring_sqe(&srv->ring)) == NULL) {
+		server_log(srv, "io_uring submission queue full");
+		return NULL;
 	}
+	sqe->fd = req->cli.fd;
+	if (req->fixed)
+		sqe->flags |= IOSQE_FIXED_FILE;
+	sqe->user_data = slab_handle(requests, req) |
+	    (uint64_t)op << URING_OP_SHIFT;
+	return sqe;
+}
 
-	server_log(req->cli.srv, "request is %d bytes long", ret);
-	server_log(req->cli.srv, "method is is %.*s",
-		   (int)req->methodlen, req->method);
-	server_log(req->cli.srv, "path is %.*s",
-		   (int)req->pathlen, req->path);
-	server_log(req->cli.srv, "HTTP version is 1.%d",
-		   (int)req->minor_version);
-	for (i = 0; i != req->nheaders; ++i)
-		server_log(req->cli.srv, "%.*s: %.*s",
-			   (int)req->headers[i].name_len,
-			   req->headers[i].name,
-			    (int)req->headers[i].value_len,
-			   req->headers[i].value); 
-	send_file(req, req->path, req->pathlen);
+/* the scratch space for a submission's arguments */
+struct uring_arg *
+request_arg(struct request *req, struct io_uring_sqe *sqe)
+{
+	struct server *srv = req->cli.srv;
 
-	free(req);
-	close(fd);
+	return &srv->args[sqe - srv->ring.sqes];
 }
 
+/*
+ * Register the socket in the fixed file slot of its own number, so
+ * the kernel can skip the descriptor lookup on every operation. The
+ * update runs when it is submitted, ahead of anything queued after it.
+ */
 void
-server_accept(int fd, short what, void *arg)
+request_fix(struct request *req)
 {
-	struct server *srv = arg;
-	struct request *req;
-	socklen_t len = sizeof(struct sockaddr_in);
-	struct timeval tv;
-	tv.tv_sec = 3; // timeout in seconds
+	struct io_uring_sqe *sqe;
 
-	server_log(srv, "accepting");
-	if ((req = malloc(sizeof(*req))) == NULL)
+	if ((unsigned int)req->cli.fd >= req->cli.srv->nfiles ||
+	    (sqe = request_sqe(req, URING_UPDATE)) == NULL)
 		return;
-	request_init(req);
+	sqe->opcode = IORING_OP_FILES_UPDATE;
+	sqe->fd = -1;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	request_arg(req, sqe)->fd = req->cli.fd;
+	sqe->addr = (uintptr_t)&request_arg(req, sqe)->fd;
+	sqe->len = 1;
+	sqe->off = req->cli.fd;
+	req->fixed = 1;
+}
 
-	// if ((req->cli.fd = accept4(fd, (struct sockaddr *)&req->cli.addr, &len, SOCK_NONBLOCK)) == -1) {
-	if ((req->cli.fd = accept(fd, (struct sockaddr *)&req->cli.addr, &len)) == -1) {
-		if (errno == EWOULDBLOCK || errno == EAGAIN)
-			printf("%s didn't get it\n", srv->name);
-		return;
-	}
-	
-	req->cli.srv = arg;
+/* empty the slot again; the socket is only closed once it is */
+void
+request_unfix(struct request *req)
+{
+	struct io_uring_sqe *sqe;
 
-	server_log(srv, "setting read event");
-	event_set(&req->cli.ev, req->cli.fd, EV_WRITE|EV_PERSIST, client_read, req);
-	if (event_add(&req->cli.ev, &tv) == -1)
-		printf("error adding\n");
+	req->fixed = 0;
+	if ((sqe = request_sqe(req, URING_UPDATE)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_FILES_UPDATE;
+	sqe->fd = -1;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	request_arg(req, sqe)->fd = -1;
+	sqe->addr = (uintptr_t)&request_arg(req, sqe)->fd;
+	sqe->len = 1;
+	sqe->off = req->cli.fd;
 }
 
+/* cancel everything in flight on the socket */
 void
-signal_handler(int sig, short event, void *arg)
+request_cancel(struct request *req)
 {
-	int i;
-	pid_t pid;
-	struct server *srv = arg;
-
-	server_log(srv, "shutting down");
+	struct io_uring_sqe *sqe;
 
-	for (i = 0; i < NWORKERS; i++) {
-		pid = workers[i];
-		server_log(srv, "killing %d", (int)pid);
-		if (pid != -1)
-			kill(pid, SIGKILL);
-	}
-	printf("goodbye\n");
-	exit(0);
+	if ((sqe = request_sqe(req, URING_CANCEL)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD;
+	if (req->fixed)
+		sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
 }
 
-
+/*
+ * Start or stop receiving. A multishot receive stays armed across
+ * requests and takes buffers from the worker's ring as data arrives,
+ * so an idle connection holds no buffer of its own.
+ */
 int
-main()
+request_recv(struct request *req, int on)
 {
-	int fd;
-	struct sockaddr_in addr;
-	struct server srv;
-	int i;
-	pid_t pid;
-
-	// set server root and log_path
-	snprintf(srv.root, sizeof(srv.root), "%s", SRV_ROOT);
-	snprintf(srv.log_path, PATH_MAX, "%s", LOG_PATH);
+	struct io_uring_sqe *sqe;
 
-	if ((srv.log_file = fopen(srv.log_path, "a")) == NULL) {
-		perror("fopen logfile");
-		return 1;
+	if (on && !req->reading) {
+		if ((sqe = request_sqe(req, URING_RECV)) == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = req->cli.srv->rbufs.bgid;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		req->reading = 1;
+		req->inflight++;
+	} else if (!on && req->reading && !req->unreading) {
+		if ((sqe = request_sqe(req, URING_CANCEL)) == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+		sqe->addr = slab_handle(requests, req) |
+		    (uint64_t)URING_RECV << URING_OP_SHIFT;
+		req->unreading = 1;
 	}
+	return 0;
+}
 
-	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-		perror("socket");
-		return 1;
+/*
+ * Send a file range as io_uring has no sendfile: splice a pipeful of
+ * the file, wait for room in the socket and splice the pipe into it,
+ * linked so the three go out as one submission. A short first splice
+ * cancels the rest; whatever reached the pipe goes out next time.
+ */
+int
+request_splice(struct request *req, struct outbuf *ob)
+{
+	struct io_uring_sqe *sqe;
+	size_t len;
+	int size;
+
+	if (req->pipe[0] == -1) {
+		if (pipe2(req->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+			return -1;
+		/* best effort: a bigger pipe means fewer round trips */
+		fcntl(req->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+		if ((size = fcntl(req->pipe[1], F_GETPIPE_SZ)) == -1)
+			return -1;
+		req->pipesize = size;
 	}
 
-	setnonblock(fd);
-		
-	bzero(&addr, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(PORT_NO);
-	addr.sin_addr.s_addr = INADDR_ANY;
-	
-	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-		perror("bind");
-		return 1;
+	/* all of the chain or none of it: a lone link would never finish */
+	if (uring_reserve(&req->cli.srv->ring, req->pipelen == 0 ? 3 : 2) ==
+	    -1) {
+		server_log(req->cli.srv, "io_uring submission queue full");
+		return -1;
 	}
-		
-	if (listen(fd, 5) == -1) {
-		perror("listen");
-		return 1;
+	len = req->pipelen;
+	if (len == 0) {
+		len = MINIMUM((size_t)(ob->end - ob->off), req->pipesize);
+		if ((sqe = request_sqe(req, URING_SPLICE_IN)) == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->splice_fd_in = ob->fd;
+		sqe->splice_off_in = ob->off;
+		sqe->fd = req->pipe[1];
+		sqe->off = (uint64_t)-1;
+		sqe->len = len;
+		sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+		req->inflight++;
+		req->sending++;
 	}
+	if ((sqe = request_sqe(req, URING_POLL)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe->poll32_events = POLLOUT;
+	req->inflight++;
+	req->sending++;
+	if ((sqe = request_sqe(req, URING_SPLICE_OUT)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->splice_fd_in = req->pipe[0];
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->off = (uint64_t)-1;
+	sqe->len = len;
+	sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+	req->inflight++;
+	req->sending++;
+	return 0;
+}
 
+/*
+ * request_flush() for io_uring: submit a send for the head of the
+ * queue unless one is in progress. Returns 1 once everything queued
+ * has been sent, 0 while a send is in progress, -1 on error.
+ */
+int
+request_send(struct request *req)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_arg *arg;
+	struct outbuf *ob, *next;
+	int iovcnt;
 
-	for (i = 0; i < NWORKERS; i++) {
-		pid = fork();
-		if (pid == 0) {
-			snprintf(srv.name, sizeof(srv.name), "worker(%d)", i);
+	if (req->is_closed)
+		return -1;
+	if (req->sending > 0)
+		return 0;
+	if ((ob = TAILQ_FIRST(&req->outq)) == NULL)
+		return 1;
+	if (ob->fd != -1)
+		return request_splice(req, ob);
 
-			event_init();
-			event_set(&srv.ev, fd, EV_READ | EV_PERSIST, server_accept, &srv);
-			event_add(&srv.ev, 0);
-			break;
-		} else {
-			snprintf(srv.name, sizeof(srv.name), "master");
-			server_log(&srv, "adding %d", pid);
-			workers[i] = pid;
-		}
+	if ((sqe = request_sqe(req, URING_SEND)) == NULL)
+		return -1;
+	arg = request_arg(req, sqe);
+	iovcnt = 0;
+	for (next = ob; next != NULL && next->fd == -1 &&
+	    iovcnt < OUT_IOVMAX; next = TAILQ_NEXT(next, entry)) {
+		arg->iov[iovcnt].iov_base = next->data + next->off;
+		arg->iov[iovcnt].iov_len = next->end - next->off;
+		iovcnt++;
 	}
+	memset(&arg->msg, 0, sizeof(arg->msg));
+	arg->msg.msg_iov = arg->iov;
+	arg->msg.msg_iovlen = iovcnt;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->addr = (uintptr_t)&arg->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | (next != NULL ? MSG_MORE : 0);
+	req->inflight++;
+	req->sending++;
+	return 0;
+}
+
+#define NSTATUS (sizeof(http_status_string) / sizeof(http_status_string[0]))
 
-	if (pid != 0) {
-	    struct event sigint;
-	    struct event sigterm;
-	    struct event sighup;
+/* "HTTP/1.1 <status>\r\n" for every status, formatted once at startup */
+struct status_line {
+	char line[64];
+	size_t len;
+} status_lines[NSTATUS];
 
-	    event_init();
-	    signal_set(&sigint, SIGINT, signal_handler, NULL);
-	    signal_set(&sigterm, SIGTERM, signal_handler, NULL);
-	    signal_set(&sighup, SIGHUP, signal_handler, NULL);
+#define CONN_KEEPALIVE "Connection: keep-alive\r\n\r\n"
+#define CONN_CLOSE "Connection: close\r\n\r\n"
+
+/*
+ * A response under construction: the head is serialized as headers
+ * are added, body segments are referenced until response_send()
+ * copies everything into the output queue in one piece.
+ */
+struct response {
+	char head[RESPONSE_HEAD_MAX];
+	size_t headlen;
+	int overflow;
+	int has_length;
+	struct iovec body[RESPONSE_IOVMAX];
+	int nbody;
+	size_t bodylen;
+};
 
-	    signal_add(&sigint, NULL);
-	    signal_add(&sigterm, NULL);
-	    signal_add(&sighup, NULL);
+void
+response_init(void)
+{
+	size_t i;
+	int n;
 
-	    snprintf(srv.name, sizeof(srv.name), "master");
+	for (i = 0; i < NSTATUS; i++) {
+		if (http_status_string[i] == NULL)
+			continue;
+		n = snprintf(status_lines[i].line, sizeof(status_lines[i].line),
+		    "HTTP/1.1 %s\r\n", http_status_string[i]);
+		assert(n > 0 && (size_t)n < sizeof(status_lines[i].line));
+		status_lines[i].len = n;
 	}
+}
+
+static void
+response_append(struct response *res, const char *buf, size_t len)
+{
+	if (res->overflow || sizeof(res->head) - res->headlen < len) {
+		res->overflow = 1;
+		return;
+	}
+	memcpy(res->head + res->headlen, buf, len);
+	res->headlen += len;
+}
+
+void
+response_start(struct response *res, int minor_version, HTTP_STATUS status)
+{
+	const struct status_line *sl = &status_lines[status];
+
+	memcpy(res->head, sl->line, sl->len);
+	if (minor_version == 0)
+		res->head[sizeof("HTTP/1.") - 1] = '0';
+	res->headlen = sl->len;
+	res->overflow = 0;
+	res->has_length = 0;
+	res->nbody = 0;
+	res->bodylen = 0;
+}
+
+void
+response_header(struct response *res, const char *name, const char *value)
+{
+	response_append(res, name, strlen(name));
+	response_append(res, ": ", 2);
+	response_append(res, value, strlen(value));
+	response_append(res, "\r\n", 2);
+}
+
+/* set Content-Length for a body that is queued separately */
+void
+response_length(struct response *res, unsigned long long len)
+{
+	char buf[32], *p = buf + sizeof(buf);
+
+	*--p = '\n';
+	*--p = '\r';
+	do
+		*--p = '0' + len % 10;
+	while ((len /= 10) != 0);
+	response_append(res, "Content-Length: ", sizeof("Content-Length: ") - 1);
+	response_append(res, p, buf + sizeof(buf) - p);
+	res->has_length = 1;
+}
+
+/* add a body segment; it must stay valid until response_send() */
+void
+response_body(struct response *res, const void *buf, size_t len)
+{
+	if (res->nbody == RESPONSE_IOVMAX) {
+		res->overflow = 1;
+		return;
+	}
+	res->body[res->nbody].iov_base = (void *)buf;
+	res->body[res->nbody].iov_len = len;
+	res->nbody++;
+	res->bodylen += len;
+}
+
+/* the end of every response head; tells the client if the socket stays open */
+const char *
+request_connection(struct request *req, size_t *len)
+{
+	if (req->keepalive) {
+		*len = sizeof(CONN_KEEPALIVE) - 1;
+		return CONN_KEEPALIVE;
+	}
+	*len = sizeof(CONN_CLOSE) - 1;
+	return CONN_CLOSE;
+}
+
+/*
+ * Finish the head (Content-Length from the body segments unless it
+ * was set, then Connection) and queue head and body as one buffer, so
+ * they leave in a single send along with whatever follows. A HEAD
+ * request gets the head alone; then 1 is returned and the caller must
+ * not queue a body that was to follow either.
+ */
+int
+response_send(struct response *res, struct request *req)
+{
+	const char *conn;
+	size_t connlen, bodylen;
+	char *p;
+	int i;
+
+	if (!res->has_length)
+		response_length(res, res->bodylen);
+	conn = request_connection(req, &connlen);
+	response_append(res, conn, connlen);
+	if (res->overflow)
+		return -1;
+
+	bodylen = req->head ? 0 : res->bodylen;
+	log_debug("responding: %d bytes", (int)(res->headlen + bodylen));
+	if ((p = request_reserve(req, res->headlen + bodylen)) == NULL)
+		return -1;
+	memcpy(p, res->head, res->headlen);
+	p += res->headlen;
+	for (i = 0; i < res->nbody && !req->head; i++) {
+		memcpy(p, res->body[i].iov_base, res->body[i].iov_len);
+		p += res->body[i].iov_len;
+	}
+	request_commit(req, res->headlen + bodylen);
+	return req->head;
+}
+
+/* an error response whose body is just the status text */
+void
+response_error(struct response *res, int minor_version, HTTP_STATUS status)
+{
+	const struct status_line *sl = &status_lines[status];
+
+	response_start(res, minor_version, status);
+	response_header(res, "Content-Type", "text/plain");
+	/* the status text without "HTTP/1.1 " and with \n for \r\n */
+	response_body(res, sl->line + sizeof("HTTP/1.1 ") - 1,
+	    sl->len - sizeof("HTTP/1.1 \r\n") + 1);
+	response_body(res, "\n", 1);
+}
+
+/* queue a complete error response */
+void
+request_error(struct request *req, HTTP_STATUS status)
+{
+	struct response res;
+
+	response_error(&res, req->minor_version, status);
+	response_send(&res, req);
+}
+
+/*
+ * A strong validator from the file's identity, size and mtime, and
+ * the coding if we compressed it ourselves.
+ */
+void
+file_etag(const struct stat *st, int made, char *buf, size_t len)
+{
+	snprintf(buf, len, "\"%llx-%llx-%llx%s%s\"",
+	    (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+	    (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+	    st->st_mtim.tv_nsec, made == ENC_IDENTITY ? "" : "-",
+	    made == ENC_IDENTITY ? "" : encodings[made].name);
+}
+
+/* an IMF-fixdate, as http_date_parse() reads it */
+void
+http_date_format(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* ETag and Last-Modified, for the client to revalidate with */
+void
+response_validators(struct response *res, const struct stat *st, int made)
+{
+	char buf[ETAG_MAX];
+
+	file_etag(st, made, buf, sizeof(buf));
+	response_header(res, "ETag", buf);
+	http_date_format(st->st_mtime, buf, sizeof(buf));
+	response_header(res, "Last-Modified", buf);
+}
+
+/* every file may have compressed variants, so every answer varies */
+void
+response_coding(struct response *res, int enc)
+{
+	if (enc != ENC_IDENTITY)
+		response_header(res, "Content-Encoding", encodings[enc].name);
+	response_header(res, "Vary", "Accept-Encoding");
+}
+
+int
+preconds_any(const struct preconds *pc)
+{
+	return pc->none_match[0] != '\0' || pc->modified_since != -1;
+}
+
+/*
+ * Whether the client's copy is current: one of its entity tags matches
+ * ours under the weak comparison or, if it sent none, the file has not
+ * changed since its date.
+ */
+int
+preconds_fresh(const struct preconds *pc, const struct stat *st, int made)
+{
+	char etag[ETAG_MAX];
+	const char *p, *end;
+	size_t taglen;
+
+	if (pc->none_match[0] == '\0')
+		return pc->modified_since != -1 &&
+		    st->st_mtime <= pc->modified_since;
+	file_etag(st, made, etag, sizeof(etag));
+	taglen = strlen(etag);
+	for (p = pc->none_match;; p = end) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '\0')
+			return 0;
+		if (*p == '*')
+			return 1;
+		if (strncmp(p, "W/", 2) == 0)
+			p += 2;
+		if (*p != '"' || (end = strchr(p + 1, '"')) == NULL)
+			return 0;
+		end++;
+		if ((size_t)(end - p) == taglen && memcmp(p, etag, taglen) == 0)
+			return 1;
+	}
+}
+
+/* the client's copy of the variant is current: validators, no body */
+void
+request_not_modified(struct request *req, struct fetch *f,
+    const struct stat *st)
+{
+	struct response res;
+
+	response_start(&res, req->minor_version, HTTP_304);
+	response_coding(&res, f->enc);
+	response_validators(&res, st, f->made);
+	/* a 304 has no body, and a Content-Length would describe the 200's */
+	res.has_length = 1;
+	response_send(&res, req);
+}
+
+/*
+ * How a file beneath the root is now, without waiting for the disk:
+ * from the fd cache, which inotify keeps current, or only if files are
+ * opened inline anyway, from the file system. Fails with EAGAIN if it
+ * would take the disk pool.
+ */
+int
+file_stat(struct server *srv, const char *path, const char *rel,
+    struct stat *st)
+{
+	if (srv->fdcache != NULL) {
+		if (fdcache_stat(srv->fdcache, path, st) == 0)
+			return 0;
+		if (errno != EAGAIN)
+			return -1;
+	}
+	if (srv->pool != NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return root_stat(srv->root_fd, rel, st);
+}
+
+/*
+ * Answer from the shared cache: with a compressed variant of the file
+ * if the client takes one and it is ready, a 304 if the client's copy
+ * is current, else copy the cached head, finish it for this connection
+ * and copy the body behind it, all straight into the output queue.
+ * Returns -1 on a miss, for a range request, if the file changed or
+ * can't be checked without the disk, or if the entry changed while it
+ * was being copied.
+ */
+int
+response_cached(struct request *req, struct fetch *f, const char *path)
+{
+	struct server *srv = req->cli.srv;
+	struct cache *cache = srv->cache;
+	struct cache_ref ref;
+	struct stat st;
+	const char *conn;
+	size_t connlen, bodylen;
+	char *p;
+
+	if (cache_find(cache, path, &ref) == -1)
+		return -1;
+	if (ref.stale) {
+		if (file_stat(srv, path, fetch_rel(f, path), &st) == -1) {
+			/* the disk pool looks and offers the file again */
+			if (errno == EAGAIN)
+				return -1;
+			cache_revalidate(cache, &ref, NULL);
+			return -1;
+		}
+		if (cache_revalidate(cache, &ref, &st) == -1)
+			return -1;
+	}
+	/* the file as the entry was made from it */
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG;
+	st.st_dev = ref.dev;
+	st.st_ino = ref.ino;
+	st.st_size = ref.size;
+	st.st_mtim = ref.mtime;
+	if (fetch_compressed(req, f, -1, &st) == 0)
+		return 0;
+	if (preconds_fresh(&f->preconds, &st, ENC_IDENTITY)) {
+		request_not_modified(req, f, &st);
+		return 0;
+	}
+	/* entries hold whole responses only */
+	if (f->ranges.n > 0)
+		return -1;
+	conn = request_connection(req, &connlen);
+	bodylen = req->head ? 0 : ref.bodylen;
+	if ((p = request_reserve(req, ref.hdrlen + connlen + bodylen)) == NULL)
+		return 0;	/* the connection is being torn down anyway */
+	if (cache_copy(cache, &ref, p, req->head ? NULL :
+	    p + ref.hdrlen + connlen) == -1)
+		return -1;
+	/* cached heads are written for HTTP/1.1 */
+	if (req->minor_version == 0)
+		p[sizeof("HTTP/1.") - 1] = '0';
+	memcpy(p + ref.hdrlen, conn, connlen);
+	request_commit(req, ref.hdrlen + connlen + bodylen);
+	return 0;
+}
+
+/*
+ * Offer a small file to the shared cache so the next request skips the
+ * disk. Entries are keyed by path, so sidecars stay out: theirs would
+ * answer requests for the sidecar itself.
+ */
+void
+cache_offer(struct cache *cache, struct fetch *f, int fd, struct stat *st)
+{
+	struct response res;
+
+	if (!S_ISREG(st->st_mode) || (size_t)st->st_size > cache_max_body(cache))
+		return;
+	/* everything but Connection, which depends on the request */
+	response_start(&res, 1, HTTP_200);
+	response_header(&res, "Content-Type", f->type);
+	response_header(&res, "Accept-Ranges", "bytes");
+	response_coding(&res, ENC_IDENTITY);
+	response_validators(&res, st, ENC_IDENTITY);
+	response_length(&res, st->st_size);
+	if (!res.overflow)
+		cache_insert(cache, f->path, fd, st, res.head, res.headlen);
+}
+
+/*
+ * Clip parsed ranges to the file, dropping those that start past its
+ * end. Returns how many are left, 0 to send the whole file (there was
+ * no usable Range or the If-Range failed) or -1 if none is satisfiable.
+ */
+int
+ranges_resolve(struct ranges *rs, const struct stat *st)
+{
+	struct byterange *r;
+	char etag[ETAG_MAX];
+	off_t size = st->st_size;
+	int i, n = 0;
+
+	if (rs->n == 0 || !S_ISREG(st->st_mode) ||
+	    (rs->if_range != -1 && rs->if_range != st->st_mtime))
+		return rs->n = 0;
+	if (rs->if_tag[0] != '\0') {
+		/* If-Range compares strongly, and ours are all strong */
+		file_etag(st, ENC_IDENTITY, etag, sizeof(etag));
+		if (strcmp(rs->if_tag, etag) != 0)
+			return rs->n = 0;
+	}
+	for (i = 0; i < rs->n; i++) {
+		r = &rs->r[i];
+		if (r->first == -1) {
+			if (r->last == 0)
+				continue;
+			r->first = r->last >= size ? 0 : size - r->last;
+			r->last = size - 1;
+		} else {
+			if (r->first >= size)
+				continue;
+			if (r->last == -1 || r->last >= size)
+				r->last = size - 1;
+		}
+		rs->r[n++] = *r;
+	}
+	rs->n = n;
+	return n > 0 ? n : -1;
+}
+
+/*
+ * Several ranges: a multipart/byteranges body. Each part has a small
+ * head in memory followed by its bytes, queued straight from the file
+ * on a descriptor of its own.
+ */
+void
+transfer_ranges(struct request *req, int fd, struct stat *st,
+    struct fetch *f)
+{
+	struct ranges *rs = &f->ranges;
+	struct response res;
+	struct byterange *r;
+	char boundary[32], type[80], heads[RANGES_MAX][256];
+	int headlen[RANGES_MAX], blen, i, pfd;
+	unsigned long long len;
+	char *p;
+
+	/* different for every version of every file */
+	blen = snprintf(boundary, sizeof(boundary), "%llx%llx",
+	    (unsigned long long)st->st_ino,
+	    (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+	    st->st_mtim.tv_nsec);
+	len = sizeof("\r\n----\r\n") - 1 + blen;
+	for (i = 0; i < rs->n; i++) {
+		r = &rs->r[i];
+		headlen[i] = snprintf(heads[i], sizeof(heads[i]),
+		    "\r\n--%s\r\nContent-Type: %s\r\n"
+		    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary,
+		    f->type, (long long)r->first, (long long)r->last,
+		    (long long)st->st_size);
+		len += headlen[i] + r->last - r->first + 1;
+	}
+
+	response_start(&res, req->minor_version, HTTP_206);
+	snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+	    boundary);
+	response_header(&res, "Content-Type", type);
+	response_header(&res, "Accept-Ranges", "bytes");
+	response_coding(&res, ENC_IDENTITY);
+	response_validators(&res, st, ENC_IDENTITY);
+	response_length(&res, len);
+	if (response_send(&res, req) != 0)
+		goto fail;
+	for (i = 0; i < rs->n; i++) {
+		r = &rs->r[i];
+		if ((p = request_reserve(req, headlen[i])) == NULL)
+			goto fail;
+		memcpy(p, heads[i], headlen[i]);
+		request_commit(req, headlen[i]);
+		if (i == rs->n - 1) {
+			pfd = fd;
+			fd = -1;
+		} else if ((pfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+			request_abort(req);
+			goto fail;
+		}
+		if (request_sendfile(req, pfd, r->first,
+		    r->last - r->first + 1) == -1)
+			goto fail;
+	}
+	if ((p = request_reserve(req, blen + 8)) == NULL)
+		return;
+	memcpy(p, "\r\n--", 4);
+	memcpy(p + 4, boundary, blen);
+	memcpy(p + 4 + blen, "--\r\n", 4);
+	request_commit(req, blen + 8);
+	return;
+
+fail:
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Send a file, or the parts of it the request's ranges ask for; the
+ * bytes in between are never read.
+ */
+void
+transfer_file(struct request *req, int fd, struct stat *st, struct fetch *f)
+{
+	struct ranges *rs = &f->ranges;
+	struct response res;
+	char buf[64];
+	off_t off = 0, len = st->st_size;
+	int n;
+
+	if ((n = ranges_resolve(rs, st)) == -1) {
+		close(fd);
+		response_error(&res, req->minor_version, HTTP_416);
+		snprintf(buf, sizeof(buf), "bytes */%lld", (long long)len);
+		response_header(&res, "Content-Range", buf);
+		response_send(&res, req);
+		return;
+	}
+	if (n > 1) {
+		transfer_ranges(req, fd, st, f);
+		return;
+	}
+
+	response_start(&res, req->minor_version, n == 1 ? HTTP_206 : HTTP_200);
+	response_header(&res, "Content-Type", f->type);
+	if (f->enc == ENC_IDENTITY)
+		response_header(&res, "Accept-Ranges", "bytes");
+	response_coding(&res, f->enc);
+	response_validators(&res, st, ENC_IDENTITY);
+	if (n == 1) {
+		off = rs->r[0].first;
+		len = rs->r[0].last - off + 1;
+		snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld",
+		    (long long)off, (long long)rs->r[0].last,
+		    (long long)st->st_size);
+		response_header(&res, "Content-Range", buf);
+	}
+	response_length(&res, len);
+	if (response_send(&res, req) != 0) {
+		close(fd);
+		return;
+	}
+	request_sendfile(req, fd, off, len);
+}
+
+/*
+ * Open a file to serve beneath the root, through the worker's fd cache
+ * when there is one; a cached failure returns its original errno
+ * without touching the disk.
+ */
+int
+file_open(struct server *srv, const char *path, const char *rel,
+    struct stat *st)
+{
+	int fd, error;
+
+	if (srv->fdcache != NULL &&
+	    ((fd = fdcache_get(srv->fdcache, path, st)) != -1 || errno != EAGAIN))
+		return fd;
+	if ((fd = root_open(srv->root_fd, rel, O_RDONLY)) == -1) {
+		error = errno;
+		if (srv->fdcache != NULL)
+			fdcache_put(srv->fdcache, path, -1, NULL, error);
+		errno = error;
+		return -1;
+	}
+	if (fstat(fd, st) == -1) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	if (srv->fdcache != NULL)
+		fdcache_put(srv->fdcache, path, fd, st, 0);
+	return fd;
+}
+
+/* where the `enc' variant of a file lives: next to it, with a suffix */
+int
+fetch_path(struct fetch *f, int enc, char *buf, size_t len)
+{
+	if ((size_t)snprintf(buf, len, "%s%s", f->path,
+	    encodings[enc].suffix) >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* the part of a variant's path below the root */
+const char *
+fetch_rel(struct fetch *f, const char *path)
+{
+	return path + f->rel;
+}
+
+/* whether a variant may be compressed for this request instead */
+int
+fetch_compressible(struct server *srv, struct fetch *f)
+{
+	return srv->zcache != NULL && (f->encs & ~(1 << ENC_IDENTITY)) != 0;
+}
+
+/*
+ * A variant compressed on the compression pool, which frees it. The
+ * file comes open, or is opened there by its path below the root.
+ */
+struct zjob {
+	struct pool_job job;
+	struct zcache *zcache;
+	struct zentry *entry;
+	int fd;
+	int root;
+	char rel[];
+};
+
+void
+zjob_run(struct pool_job *job)
+{
+	struct zjob *zj = (struct zjob *)job;
+
+	if (zj->fd == -1)
+		zj->fd = root_open(zj->root, zj->rel, O_RDONLY);
+	/* without a file, the fill fails and the entry is dropped */
+	zcache_fill(zj->zcache, zj->entry, zj->fd);
+	if (zj->fd != -1)
+		close(zj->fd);
+	free(zj);
+}
+
+/*
+ * Answer with the compressed variant of a file that has no sidecar, if
+ * one is ready; if not, have it made for the requests to come, from fd
+ * or, with none at hand, from the file opened on the pool. Returns -1
+ * if the request still needs answering.
+ */
+int
+fetch_compressed(struct request *req, struct fetch *f, int fd,
+    struct stat *st)
+{
+	struct server *srv = req->cli.srv;
+	struct zentry *e, *fill;
+	struct zjob *zj;
+	struct response res;
+	const char *data, *rel;
+	size_t len;
+	int enc;
+
+	if (!fetch_compressible(srv, f) || !S_ISREG(st->st_mode) ||
+	    st->st_size < ZCACHE_MIN_FILE ||
+	    (size_t)st->st_size > zcache_max_file(srv->zcache))
+		return -1;
+	for (enc = 0; !(f->encs & (1 << enc)); enc++)
+		; /* empty */
+
+	/* allocated first: an entry handed out to fill must be filled */
+	rel = fetch_rel(f, f->path);
+	if ((zj = malloc(sizeof(*zj) + strlen(rel) + 1)) == NULL)
+		return -1;
+	e = zcache_get(srv->zcache, f->path, enc, st, &fill);
+	if (fill != NULL) {
+		zj->job.cq = NULL;
+		zj->job.run = zjob_run;
+		zj->zcache = srv->zcache;
+		zj->entry = fill;
+		zj->fd = fd == -1 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		zj->root = srv->root_fd;
+		strcpy(zj->rel, rel);
+		pool_submit(srv->zpool, &zj->job);
+	} else
+		free(zj);
+	if (e == NULL)
+		return -1;
+
+	f->enc = f->made = enc;
+	if (preconds_fresh(&f->preconds, st, enc))
+		request_not_modified(req, f, st);
+	else {
+		data = zentry_data(e, &len);
+		response_start(&res, req->minor_version, HTTP_200);
+		response_header(&res, "Content-Type", f->type);
+		response_coding(&res, enc);
+		response_validators(&res, st, enc);
+		response_body(&res, data, len);
+		response_send(&res, req);
+	}
+	zcache_put(srv->zcache, e);
+	return 0;
+}
+
+/* a file read into the shared cache on a pool thread */
+struct filljob {
+	struct pool_job job;
+	struct cache *cache;
+	int fd;
+	struct stat st;
+	struct fetch fetch;
+};
+
+void
+fill_run(struct pool_job *job)
+{
+	struct filljob *fj = (struct filljob *)job;
+
+	cache_offer(fj->cache, &fj->fetch, fj->fd, &fj->st);
+	close(fj->fd);
+	free(fj);
+}
+
+/*
+ * Offer an open file to the shared cache. Reading it may wait for the
+ * disk, so with a pool that is done there, on a descriptor of its own;
+ * nothing waits for it.
+ */
+void
+cache_fill(struct server *srv, struct fetch *f, int fd, struct stat *st)
+{
+	struct filljob *fj;
+
+	if (!S_ISREG(st->st_mode) ||
+	    (size_t)st->st_size > cache_max_body(srv->cache))
+		return;
+	if (srv->pool == NULL) {
+		cache_offer(srv->cache, f, fd, st);
+		return;
+	}
+	if ((fj = malloc(sizeof(*fj))) == NULL)
+		return;
+	if ((fj->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		free(fj);
+		return;
+	}
+	fj->job.cq = NULL;
+	fj->job.run = fill_run;
+	fj->cache = srv->cache;
+	fj->st = *st;
+	fj->fetch = *f;
+	pool_submit(srv->pool, &fj->job);
+}
+
+/*
+ * Answer with the open variant of f: compressed from memory, 304 if the
+ * client's copy is current, else the file itself. `offer' passes the
+ * file on to the shared cache.
+ */
+void
+fetch_answer(struct request *req, struct fetch *f, int fd, struct stat *st,
+    int offer)
+{
+	struct server *srv = req->cli.srv;
+
+	if (f->enc == ENC_IDENTITY && fetch_compressed(req, f, fd, st) == 0) {
+		close(fd);
+		return;
+	}
+	if (preconds_fresh(&f->preconds, st, ENC_IDENTITY)) {
+		close(fd);
+		request_not_modified(req, f, st);
+		return;
+	}
+	if (offer && srv->cache != NULL && f->enc == ENC_IDENTITY)
+		cache_fill(srv, f, fd, st);
+	transfer_file(req, fd, st, f);
+}
+
+/*
+ * Files opened on a disk pool thread for a request: each variant tried
+ * until one is there. Whoever asked may be gone by the time it is
+ * done, so it is found again by handle.
+ */
+struct diskjob {
+	struct pool_job job;
+	uintptr_t req;
+	int root;
+	struct cache *cache;	/* to offer the file to, or NULL */
+	struct fetch fetch;	/* its `enc' ends up at the variant found */
+	int fresh;		/* the client's copy is current, fd not opened */
+	struct {
+		int tried;
+		int fd;
+		int error;
+		struct stat st;
+	} found[ENC_MAX];
+};
+
+/*
+ * Runs on a pool thread: everything that may wait for the disk. A
+ * conditional request whose copy is current needs only a stat(). Small
+ * files are read whole into the shared cache, larger ones have their
+ * readahead started so the first sends find the pages in memory.
+ */
+void
+disk_open(struct pool_job *job)
+{
+	struct diskjob *dj = (struct diskjob *)job;
+	struct fetch *f = &dj->fetch;
+	char path[PATH_MAX];
+	struct stat *st;
+	int *fd;
+
+	for (; f->enc < ENC_MAX; f->enc++) {
+		if (!(f->encs & (1 << f->enc)))
+			continue;
+		dj->found[f->enc].tried = 1;
+		fd = &dj->found[f->enc].fd;
+		st = &dj->found[f->enc].st;
+		if (fetch_path(f, f->enc, path, sizeof(path)) == -1) {
+			dj->found[f->enc].error = errno;
+			continue;
+		}
+		if (preconds_any(&f->preconds) &&
+		    root_stat(dj->root, fetch_rel(f, path), st) == 0 &&
+		    S_ISREG(st->st_mode) &&
+		    preconds_fresh(&f->preconds, st, ENC_IDENTITY)) {
+			dj->fresh = 1;
+			return;
+		}
+		if ((*fd = root_open(dj->root, fetch_rel(f, path),
+		    O_RDONLY)) == -1) {
+			dj->found[f->enc].error = errno;
+			continue;
+		}
+		/* only regular files are served, whatever else is there */
+		if (fstat(*fd, st) == -1 || !S_ISREG(st->st_mode)) {
+			dj->found[f->enc].error = errno;
+			close(*fd);
+			*fd = -1;
+			continue;
+		}
+		if (dj->cache != NULL && f->enc == ENC_IDENTITY &&
+		    (size_t)st->st_size <= cache_max_body(dj->cache))
+			cache_offer(dj->cache, f, *fd, st);
+		else
+			posix_fadvise(*fd, 0, st->st_size, POSIX_FADV_WILLNEED);
+		return;
+	}
+}
+
+/* hand the open to the disk pool; the request answers nothing meanwhile */
+int
+disk_submit(struct request *req, struct fetch *f)
+{
+	struct server *srv = req->cli.srv;
+	struct diskjob *dj;
+	int i;
+
+	if ((dj = malloc(sizeof(*dj))) == NULL)
+		return -1;
+	dj->job.cq = &srv->diskq;
+	dj->job.run = disk_open;
+	dj->req = slab_handle(requests, req);
+	dj->root = srv->root_fd;
+	dj->cache = srv->cache;
+	dj->fetch = *f;
+	dj->fresh = 0;
+	for (i = 0; i < ENC_MAX; i++) {
+		dj->found[i].tried = 0;
+		dj->found[i].fd = -1;
+		dj->found[i].error = 0;
+	}
+	pool_submit(srv->pool, &dj->job);
+	req->waiting = 1;
+	srv->stats.offloaded++;
+	return 0;
+}
+
+/* back on the worker: remember the outcomes and answer with them */
+void
+disk_done(struct pool_job *job, void *arg)
+{
+	struct diskjob *dj = (struct diskjob *)job;
+	struct fetch *f = &dj->fetch;
+	struct server *srv = arg;
+	struct request *req;
+	char path[PATH_MAX];
+	int fd = -1, i;
+
+	for (i = 0; i < ENC_MAX; i++) {
+		if (!dj->found[i].tried || fetch_path(f, i, path,
+		    sizeof(path)) == -1)
+			continue;
+		if (srv->fdcache != NULL)
+			fdcache_put(srv->fdcache, path, dj->found[i].fd,
+			    &dj->found[i].st, dj->found[i].error);
+		if (dj->found[i].fd != -1)
+			fd = dj->found[i].fd;
+	}
+	if ((req = slab_lookup(requests, dj->req)) == NULL || req->is_closed) {
+		if (fd != -1)
+			close(fd);
+		free(dj);
+		return;
+	}
+	req->waiting = 0;
+	if (dj->fresh)
+		request_not_modified(req, f, &dj->found[f->enc].st);
+	else if (fd == -1) {
+		log_debug("404: %s NOTFOUND", f->path);
+		request_error(req, HTTP_404);
+	} else
+		fetch_answer(req, f, fd, &dj->found[f->enc].st, 0);
+	free(dj);
+	/* carry on with whatever was pipelined behind it */
+	client_run(req);
+}
+
+/*
+ * Look for the variant of f that f->enc names: 1 with it open, 0 if
+ * there is no such sidecar, or -1 once the request is answered or
+ * waits for the disk pool.
+ */
+int
+fetch_variant(struct request *req, struct fetch *f, int *fdp,
+    struct stat *st)
+{
+	struct server *srv = req->cli.srv;
+	char path[PATH_MAX];
+	int fd;
+
+	if (fetch_path(f, f->enc, path, sizeof(path)) == -1)
+		fd = -1;
+	else {
+		/* only identity is cached; its entry knows the file */
+		if (srv->cache != NULL && f->enc == ENC_IDENTITY &&
+		    response_cached(req, f, path) == 0)
+			return -1;
+		if (srv->pool == NULL)
+			fd = file_open(srv, path, fetch_rel(f, path), st);
+		else if (srv->fdcache == NULL ||
+		    ((fd = fdcache_get(srv->fdcache, path, st)) == -1 &&
+		    errno == EAGAIN)) {
+			if (disk_submit(req, f) == -1)
+				request_error(req, HTTP_500);
+			return -1;
+		}
+	}
+	if (fd != -1 && !S_ISREG(st->st_mode)) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 && f->enc != ENC_IDENTITY)
+		return 0;
+	if (fd == -1) {
+		log_debug("404: %s NOTFOUND", path);
+		request_error(req, HTTP_404);
+		return -1;
+	}
+	*fdp = fd;
+	return 1;
+}
+
+/*
+ * Answer with the most preferred variant the client takes: a sidecar
+ * precompressed next to the file, one compressed in memory, or the
+ * file itself. Each comes from the shared cache or a file the fd cache
+ * holds open, or as a 304 if the client's copy is current; anything
+ * else may have to wait for the disk, so it goes to the pool.
+ */
+void
+send_file(struct request *req, const char *target, size_t len)
+{
+	struct server *srv = req->cli.srv;
+	struct fetch f;
+	struct stat st;
+	int fd;
+
+	f.rel = snprintf(f.path, sizeof(f.path), "%s/", srv->root);
+	if (f.rel >= sizeof(f.path) || path_normalize(target, len,
+	    f.path + f.rel, sizeof(f.path) - f.rel) == -1) {
+		request_error(req, HTTP_400);
+		return;
+	}
+	f.type = mime_type(f.path);
+
+	request_ranges(req, &f.ranges);
+	request_preconds(req, &f.preconds);
+	/* byte positions are the file's own: ranges are served as is */
+	f.encs = f.ranges.n > 0 ? 1 << ENC_IDENTITY : request_encodings(req);
+	f.made = ENC_IDENTITY;
+	for (f.enc = 0; f.enc < ENC_MAX; f.enc++) {
+		if (!(f.encs & (1 << f.enc)))
+			continue;
+		switch (fetch_variant(req, &f, &fd, &st)) {
+		case 0:
+			continue;
+		case 1:
+			fetch_answer(req, &f, fd, &st, 1);
+			break;
+		}
+		return;
+	}
+}
+
+/* a file beneath the root */
+void
+route_static(struct request *req, const struct route_params *rp, void *arg)
+{
+	(void)rp;
+	(void)arg;
+	send_file(req, req->in->target, req->in->targetlen);
+}
+
+/* this worker's counters, as plain text */
+void
+route_status(struct request *req, const struct route_params *rp, void *arg)
+{
+	struct server *srv = req->cli.srv;
+	struct accept_stats *st = &srv->stats;
+	struct response res;
+	struct slab_stats ss;
+	struct cache_stats cs;
+	struct fdcache_stats fs;
+	struct zcache_stats zs;
+	char buf[1024];
+	int n;
+
+	(void)rp;
+	(void)arg;
+	slab_stats(requests, &ss);
+	n = snprintf(buf, sizeof(buf), "worker: %s\nconnections: %zu\n"
+	    "accepted: %llu\ndisk opens: %llu\nproxied: %llu\n", srv->name,
+	    ss.inuse, st->accepted, st->offloaded, st->proxied);
+	if (srv->cache != NULL && (size_t)n < sizeof(buf)) {
+		cache_stats(srv->cache, &cs);
+		n += snprintf(buf + n, sizeof(buf) - n,
+		    "cache: %llu hits, %llu misses\n",
+		    (unsigned long long)cs.hits, (unsigned long long)cs.misses);
+	}
+	if (srv->fdcache != NULL && (size_t)n < sizeof(buf)) {
+		fdcache_stats(srv->fdcache, &fs);
+		n += snprintf(buf + n, sizeof(buf) - n,
+		    "file cache: %llu hits, %llu negative hits, %llu misses\n",
+		    (unsigned long long)fs.hits,
+		    (unsigned long long)fs.negative_hits,
+		    (unsigned long long)fs.misses);
+	}
+	if (srv->zcache != NULL && (size_t)n < sizeof(buf)) {
+		zcache_stats(srv->zcache, &zs);
+		n += snprintf(buf + n, sizeof(buf) - n,
+		    "compression cache: %llu hits, %llu misses, %zu bytes\n",
+		    (unsigned long long)zs.hits, (unsigned long long)zs.misses,
+		    zs.bytes);
+	}
+	if ((size_t)n >= sizeof(buf))
+		n = sizeof(buf) - 1;
+
+	response_start(&res, req->minor_version, HTTP_200);
+	response_header(&res, "Content-Type", "text/plain");
+	response_header(&res, "Cache-Control", "no-store");
+	response_body(&res, buf, n);
+	response_send(&res, req);
+}
+
+/* whether a comma-separated header value lists token */
+int
+header_has_token(const struct phr_header *h, const char *token)
+{
+	const char *p, *end, *e;
+	size_t len = strlen(token);
+
+	if (h == NULL)
+		return 0;
+	for (p = h->value, end = p + h->value_len; p < end; p = e + 1) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if ((e = memchr(p, ',', end - p)) == NULL)
+			e = end;
+		if (e - p >= (ptrdiff_t)len && strncasecmp(p, token, len) == 0) {
+			for (p += len; p < e && (*p == ' ' || *p == '\t'); p++)
+				; /* empty */
+			if (p == e)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Whether a header is about one connection only, so a proxy doesn't
+ * pass it on: the standard hop-by-hop ones and those Connection names.
+ */
+int
+header_hop(const struct phr_header *h, const struct phr_header *conn)
+{
+	static const char *const hop[] = { "connection", "keep-alive",
+	    "proxy-connection", "te", "trailer", "transfer-encoding",
+	    "upgrade" };
+	char name[64];
+	size_t i;
+
+	for (i = 0; i < sizeof(hop) / sizeof(hop[0]); i++)
+		if (h->name_len == strlen(hop[i]) &&
+		    strncasecmp(h->name, hop[i], h->name_len) == 0)
+			return 1;
+	if (conn == NULL || h->name_len >= sizeof(name))
+		return 0;
+	memcpy(name, h->name, h->name_len);
+	name[h->name_len] = '\0';
+	return header_has_token(conn, name);
+}
+
+/* the first header called name, or NULL */
+const struct phr_header *
+header_find(const struct phr_header *hs, size_t n, const char *name)
+{
+	size_t i, len = strlen(name);
+
+	for (i = 0; i < n; i++)
+		if (hs[i].name_len == len &&
+		    strncasecmp(hs[i].name, name, len) == 0)
+			return &hs[i];
+	return NULL;
+}
+
+void upconn_event(int, short, void *);
+void upconn_timeout(void *);
+
+/*
+ * Wait for `what' on the backend for up to secs, or for nothing with
+ * 0. The event stays armed while what it waits for stays the same.
+ */
+void
+upconn_wait(struct upconn *c, short what, int secs)
+{
+	if (c->evwhat != what) {
+		if (c->evwhat != 0)
+			event_del(&c->ev);
+		c->evwhat = what;
+		if (what != 0) {
+			server_event_set(c->srv, &c->ev, c->fd,
+			    what | EV_PERSIST, upconn_event, c);
+			event_add(&c->ev, NULL);
+		}
+	}
+	if (what != 0)
+		timer_set(&c->srv->timers, &c->timer, secs * 1000);
+	else
+		timer_cancel(&c->srv->timers, &c->timer);
+}
+
+void
+upconn_close(struct upconn *c)
+{
+	upconn_wait(c, 0, 0);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+/* a connection to backend b: one from the pool unless `fresh', or a new one */
+struct upconn *
+upconn_get(struct server *srv, const struct upstream *up, int b, int fresh)
+{
+	struct proxy_pool *pp = &srv->proxies[up->id];
+	struct upconn *c;
+	int fd, one = 1;
+
+	if (!fresh && (c = SLIST_FIRST(&pp->idle[b])) != NULL) {
+		SLIST_REMOVE_HEAD(&pp->idle[b], entry);
+		pp->nidle[b]--;
+		c->reused = 1;
+		return c;
+	}
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0)) == -1)
+		return NULL;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((connect(fd, (const struct sockaddr *)&up->backends[b],
+	    sizeof(up->backends[b])) == -1 && errno != EINPROGRESS) ||
+	    (c = calloc(1, sizeof(*c))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	c->srv = srv;
+	c->up = up;
+	c->backend = b;
+	c->fd = fd;
+	timer_init(&c->timer, upconn_timeout, c);
+	return c;
+}
+
+/*
+ * The request as backend b gets it: the client's head with the path
+ * it was routed by and without its hop-by-hop headers, who the client
+ * is, a Host if the client sent none, and the body. The body's length
+ * is the one it was read by, whatever else the client said it was.
+ */
+char *
+proxy_request(struct request *req, const struct upstream *up, int b,
+    size_t *lenp)
+{
+	struct reqbuf *in = req->in;
+	const struct phr_header *h, *conn = in->known[HDR_CONNECTION];
+	const struct sockaddr_in *sin = &up->backends[b];
+	char addr[INET_ADDRSTRLEN], host[INET_ADDRSTRLEN];
+	const char *query, *end = in->path + in->pathlen;
+	socklen_t alen = sizeof(req->cli.addr);
+	size_t i, cap, n;
+	char *out;
+
+	/* io_uring's multishot accept leaves it to whoever needs it */
+	if (req->cli.addr.sin_family == 0)
+		getpeername(req->cli.fd, (struct sockaddr *)&req->cli.addr,
+		    &alen);
+	for (query = in->path; query < end && *query != '?' && *query != '#';
+	    query++)
+		; /* empty */
+	if (query < end && *query == '#')
+		query = end;
+	inet_ntop(AF_INET, &req->cli.addr.sin_addr, addr, sizeof(addr));
+	inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+	cap = in->methodlen + in->targetlen + (end - query) +
+	    sizeof(" HTTP/1.1\r\n") + sizeof("X-Forwarded-For: \r\n") +
+	    sizeof(addr) + sizeof("Host: :65535\r\n") + sizeof(host) +
+	    sizeof("Content-Length: 18446744073709551615\r\n") +
+	    sizeof(CONN_KEEPALIVE) + in->contentlen;
+	for (i = 0; i < in->nheaders; i++)
+		cap += in->headers[i].name_len + in->headers[i].value_len + 4;
+	if ((out = malloc(cap)) == NULL)
+		return NULL;
+
+	n = sprintf(out, "%.*s %.*s%.*s HTTP/1.1\r\n", (int)in->methodlen,
+	    in->method, (int)in->targetlen, in->target, (int)(end - query),
+	    query);
+	/* an HTTP/1.0 client may leave it out; HTTP/1.1 requires it */
+	if (in->known[HDR_HOST] == NULL)
+		n += sprintf(out + n, "Host: %s:%u\r\n", host,
+		    ntohs(sin->sin_port));
+	for (i = 0; i < in->nheaders; i++) {
+		h = &in->headers[i];
+		/* a folded line has no name and goes with the one skipped */
+		if (h->name == NULL || header_hop(h, conn) ||
+		    header_lookup(h->name, h->name_len) == HDR_CONTENT_LENGTH)
+			continue;
+		memcpy(out + n, h->name, h->name_len);
+		n += h->name_len;
+		out[n++] = ':';
+		out[n++] = ' ';
+		memcpy(out + n, h->value, h->value_len);
+		n += h->value_len;
+		out[n++] = '\r';
+		out[n++] = '\n';
+	}
+	if (in->known[HDR_CONTENT_LENGTH] != NULL)
+		n += sprintf(out + n, "Content-Length: %zu\r\n",
+		    in->contentlen);
+	n += sprintf(out + n, "X-Forwarded-For: %s\r\n%s", addr,
+	    CONN_KEEPALIVE);
+	memcpy(out + n, in->content, in->contentlen);
+	*lenp = n + in->contentlen;
+	return out;
+}
+
+/*
+ * Send a request to backend b of the group; `fresh' asks for a new
+ * connection rather than a kept-alive one. The request is the
+ * connection's from now on.
+ */
+int
+proxy_send(struct request *req, const struct upstream *up, int b, char *out,
+    size_t outlen, int idempotent, int fresh)
+{
+	struct server *srv = req->cli.srv;
+	struct proxy_pool *pp = &srv->proxies[up->id];
+	struct upconn *c;
+
+	if ((c = upconn_get(srv, up, b, fresh)) == NULL)
+		return -1;
+	pp->load.outstanding[b]++;
+	c->req = req;
+	c->out = out;
+	c->outlen = outlen;
+	c->outoff = 0;
+	c->idempotent = idempotent;
+	c->state = UPCONN_SENDING;
+	c->buflen = 0;
+	c->received = 0;
+	c->replied = 0;
+	c->paused = 0;
+	memset(&c->dec, 0, sizeof(c->dec));
+	c->dec.consume_trailer = 1;
+	req->upstream = c;
+	req->waiting = 1;
+	upconn_wait(c, EV_WRITE, UPSTREAM_TIMEOUT);
+	return 0;
+}
+
+/*
+ * Take the request off the connection, which leaves the backend's
+ * count of requests in flight; it may pipeline the next one now.
+ */
+struct request *
+proxy_detach(struct upconn *c)
+{
+	struct request *req = c->req;
+
+	c->srv->proxies[c->up->id].load.outstanding[c->backend]--;
+	c->req = NULL;
+	free(c->out);
+	c->out = NULL;
+	if (req != NULL) {
+		req->upstream = NULL;
+		req->waiting = 0;
+	}
+	return req;
+}
+
+/* back to the pool if it can carry another request, else closed */
+void
+proxy_release(struct upconn *c, int reuse)
+{
+	struct proxy_pool *pp = &c->srv->proxies[c->up->id];
+
+	if (!reuse || pp->nidle[c->backend] >= UPSTREAM_IDLE_MAX) {
+		upconn_close(c);
+		return;
+	}
+	c->state = UPCONN_IDLE;
+	SLIST_INSERT_HEAD(&pp->idle[c->backend], c, entry);
+	pp->nidle[c->backend]++;
+	/* anything from an idle backend means it is closing */
+	upconn_wait(c, EV_READ, UPSTREAM_IDLE_TIMEOUT);
+}
+
+/* the response is all through: carry on with what the client pipelined */
+void
+proxy_end(struct upconn *c, int reuse)
+{
+	struct request *req;
+
+	req = proxy_detach(c);
+	proxy_release(c, reuse);
+	if (req != NULL && !req->is_closed)
+		client_run(req);
+}
+
+/* the client is gone, so the response can't be finished */
+void
+proxy_abandon(struct upconn *c)
+{
+	proxy_detach(c);
+	proxy_release(c, 0);
+}
+
+/* answer with an error if the response hasn't started, else cut it off */
+void
+proxy_fail(struct upconn *c, HTTP_STATUS status)
+{
+	struct request *req;
+	int replied = c->replied;
+
+	req = proxy_detach(c);
+	proxy_release(c, 0);
+	if (req == NULL || req->is_closed)
+		return;
+	if (replied)
+		request_abort(req);
+	else
+		request_error(req, status);
+	client_run(req);
+}
+
+/*
+ * A kept-alive connection failed before the backend sent a byte: it
+ * likely closed the connection meanwhile, so send the request again on
+ * a new one, if sending it twice does no harm. Anything else is the
+ * backend's failure.
+ */
+void
+proxy_retry(struct upconn *c)
+{
+	const struct upstream *up = c->up;
+	struct request *req;
+	size_t outlen = c->outlen;
+	int b = c->backend;
+	char *out;
+
+	if (!c->reused || !c->idempotent || c->received) {
+		proxy_fail(c, HTTP_502);
+		return;
+	}
+	out = c->out;
+	c->out = NULL;
+	req = proxy_detach(c);
+	proxy_release(c, 0);
+	if (req == NULL || req->is_closed) {
+		free(out);
+		return;
+	}
+	if (proxy_send(req, up, b, out, outlen, 1, 1) == -1) {
+		free(out);
+		request_error(req, HTTP_502);
+		client_run(req);
+	}
+}
+
+/* client output, chunked if the body's length isn't known up front */
+int
+proxy_emit(struct upconn *c, const char *data, size_t len)
+{
+	struct request *req = c->req;
+	char *p;
+	int n;
+
+	if (len == 0)
+		return 0;
+	if (!c->rechunk) {
+		if ((p = request_reserve(req, len)) == NULL)
+			return -1;
+		memcpy(p, data, len);
+		request_commit(req, len);
+		return 0;
+	}
+	if ((p = request_reserve(req, len + 20)) == NULL)
+		return -1;
+	n = sprintf(p, "%zx\r\n", len);
+	memcpy(p + n, data, len);
+	memcpy(p + n + len, "\r\n", 2);
+	request_commit(req, n + len + 2);
+	return 0;
+}
+
+/*
+ * Pass a backend's response head on to the client and work out how its
+ * body ends. One whose length isn't given is chunked for an HTTP/1.1
+ * client, and ends the connection of an HTTP/1.0 one.
+ */
+int
+proxy_head(struct upconn *c, int minor, int status, const char *msg,
+    size_t msglen, struct phr_header *hs, size_t nh)
+{
+	struct request *req = c->req;
+	const struct phr_header *conn, *te, *cl;
+	unsigned long long n;
+	const char *v, *end;
+	size_t i, cap, len, connlen;
+	char *p;
+
+	conn = header_find(hs, nh, "Connection");
+	te = header_find(hs, nh, "Transfer-Encoding");
+	cl = header_find(hs, nh, "Content-Length");
+	c->keepalive = minor >= 1 ? !header_has_token(conn, "close") :
+	    header_has_token(conn, "keep-alive");
+	if (c->req->head || status == 204 || status == 304)
+		c->framing = BODY_NONE;
+	else if (te != NULL) {
+		c->framing = te->value_len >= 7 && strncasecmp(te->value +
+		    te->value_len - 7, "chunked", 7) == 0 ?
+		    BODY_CHUNKED : BODY_CLOSE;
+		cl = NULL;
+	} else if (cl != NULL) {
+		c->framing = BODY_LENGTH;
+		n = 0;
+		for (v = cl->value, end = v + cl->value_len; v < end; v++) {
+			if (*v < '0' || *v > '9' || n > ULLONG_MAX / 10 - 1)
+				return -1;
+			n = n * 10 + (*v - '0');
+		}
+		if (cl->value_len == 0)
+			return -1;
+		c->remaining = n;
+	} else
+		c->framing = BODY_CLOSE;
+	if (c->framing == BODY_CLOSE)
+		c->keepalive = 0;
+	c->rechunk = (c->framing == BODY_CHUNKED ||
+	    c->framing == BODY_CLOSE) && req->minor_version >= 1;
+	if ((c->framing == BODY_CHUNKED || c->framing == BODY_CLOSE) &&
+	    !c->rechunk) {
+		req->keepalive = 0;
+		req->closing = 1;
+	}
+
+	cap = msglen + 32 + sizeof("Transfer-Encoding: chunked\r\n") +
+	    sizeof(CONN_KEEPALIVE);
+	for (i = 0; i < nh; i++)
+		cap += hs[i].name_len + hs[i].value_len + 4;
+	if ((p = request_reserve(req, cap)) == NULL)
+		return -1;
+	len = sprintf(p, "HTTP/1.%d %d %.*s\r\n", req->minor_version, status,
+	    (int)msglen, msg);
+	for (i = 0; i < nh; i++) {
+		if (hs[i].name == NULL || header_hop(&hs[i], conn) ||
+		    (&hs[i] != cl && hs[i].name_len == 14 &&
+		    strncasecmp(hs[i].name, "Content-Length", 14) == 0))
+			continue;
+		memcpy(p + len, hs[i].name, hs[i].name_len);
+		len += hs[i].name_len;
+		p[len++] = ':';
+		p[len++] = ' ';
+		memcpy(p + len, hs[i].value, hs[i].value_len);
+		len += hs[i].value_len;
+		p[len++] = '\r';
+		p[len++] = '\n';
+	}
+	if (c->rechunk)
+		len += sprintf(p + len, "Transfer-Encoding: chunked\r\n");
+	v = request_connection(req, &connlen);
+	memcpy(p + len, v, connlen);
+	request_commit(req, len + connlen);
+	c->replied = 1;
+	c->state = UPCONN_BODY;
+	return 0;
+}
+
+/*
+ * Parse what there is of a response head, from `prev' bytes already
+ * seen. Interim 1xx responses are dropped. Returns the head's length
+ * once it has been passed on, -2 if it is incomplete or -1.
+ */
+int
+proxy_parse_head(struct upconn *c, size_t prev)
+{
+	struct phr_header hs[100];
+	size_t nh = sizeof(hs) / sizeof(hs[0]), msglen;
+	const char *msg;
+	int ret, minor, status;
+
+	ret = phr_parse_response(c->buf, c->buflen, &minor, &status, &msg,
+	    &msglen, hs, &nh, prev);
+	if (ret < 0)
+		return ret;
+	if (status >= 100 && status < 200) {
+		/* nothing is upgraded: there is nobody to talk to past us */
+		if (status == 101)
+			return -1;
+		memmove(c->buf, c->buf + ret, c->buflen - ret);
+		c->buflen -= ret;
+		return proxy_parse_head(c, 0);
+	}
+	if (proxy_head(c, minor, status, msg, msglen, hs, nh) == -1)
+		return -1;
+	return ret;
+}
+
+/* pass body bytes on; 1 once the body is over, -1 if it is malformed */
+int
+proxy_body(struct upconn *c, char *data, size_t len)
+{
+	ssize_t ret;
+
+	switch (c->framing) {
+	case BODY_NONE:
+		if (len > 0)
+			c->keepalive = 0;
+		return 1;
+	case BODY_LENGTH:
+		if (len > c->remaining) {
+			len = c->remaining;
+			c->keepalive = 0;
+		}
+		if (proxy_emit(c, data, len) == -1)
+			return -1;
+		c->remaining -= len;
+		return c->remaining == 0;
+	case BODY_CHUNKED:
+		if ((ret = phr_decode_chunked(&c->dec, data, &len)) == -1 ||
+		    proxy_emit(c, data, len) == -1)
+			return -1;
+		if (ret == -2)
+			return 0;
+		if (ret > 0)
+			c->keepalive = 0;
+		return 1;
+	default:
+		/* BODY_CLOSE: the backend hanging up ends it */
+		return proxy_emit(c, data, len) == -1 ? -1 : 0;
+	}
+}
+
+/* the body is over: end a re-chunked one */
+void
+proxy_finish(struct upconn *c)
+{
+	/* the last chunk goes out as it is */
+	if (c->rechunk) {
+		c->rechunk = 0;
+		if (proxy_emit(c, "0\r\n\r\n", 5) == -1) {
+			proxy_fail(c, HTTP_502);
+			return;
+		}
+	}
+	proxy_end(c, c->keepalive);
+}
+
+/* send what is left of the request, then wait for the answer */
+void
+proxy_write(struct upconn *c)
+{
+	ssize_t n;
+
+	while ((n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff)) ==
+	    -1 && errno == EINTR)
+		; /* empty */
+	if (n == -1 && errno != EAGAIN) {
+		proxy_retry(c);
+		return;
+	}
+	if (n > 0)
+		c->outoff += n;
+	if (c->outoff < c->outlen) {
+		upconn_wait(c, EV_WRITE, UPSTREAM_TIMEOUT);
+		return;
+	}
+	c->state = UPCONN_HEAD;
+	upconn_wait(c, EV_READ, UPSTREAM_TIMEOUT);
+}
+
+/*
+ * Take in what the backend sent and queue it for the client, a buffer
+ * at a time: a body never sits here whole. Reading stops while the
+ * client's queue is past its high-water mark.
+ */
+void
+proxy_read(struct upconn *c)
+{
+	struct request *req = c->req;
+	size_t prev = c->buflen;
+	ssize_t n;
+	int ret, done;
+
+	while ((n = read(c->fd, c->buf + c->buflen,
+	    sizeof(c->buf) - c->buflen)) == -1 && errno == EINTR)
+		; /* empty */
+	if (n == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		if (c->state == UPCONN_HEAD)
+			proxy_retry(c);
+		else if (n == 0 && c->framing == BODY_CLOSE)
+			proxy_finish(c);
+		else
+			proxy_fail(c, HTTP_502);
+		return;
+	}
+	c->buflen += n;
+	c->received = 1;
+
+	if (c->state == UPCONN_HEAD) {
+		if ((ret = proxy_parse_head(c, prev)) == -2 &&
+		    c->buflen < sizeof(c->buf)) {
+			upconn_wait(c, EV_READ, UPSTREAM_TIMEOUT);
+			return;
+		}
+		if (ret < 0) {
+			proxy_fail(c, HTTP_502);
+			return;
+		}
+		done = proxy_body(c, c->buf + ret, c->buflen - ret);
+	} else
+		done = proxy_body(c, c->buf, c->buflen);
+	c->buflen = 0;
+	if (done == -1) {
+		proxy_fail(c, HTTP_502);
+		return;
+	}
+	if (done == 1) {
+		proxy_finish(c);
+		return;
+	}
+	if (req->outlen >= c->srv->out_highwat) {
+		/* the client's own deadline covers the wait */
+		c->paused = 1;
+		upconn_wait(c, 0, 0);
+	} else
+		upconn_wait(c, EV_READ, UPSTREAM_TIMEOUT);
+	/* send what came in; this may close the client and with it c */
+	if (!req->is_closed)
+		client_run(req);
+}
+
+/* an idle connection the backend closed or we kept long enough */
+void
+upconn_expire(struct upconn *c)
+{
+	struct proxy_pool *pp = &c->srv->proxies[c->up->id];
+
+	SLIST_REMOVE(&pp->idle[c->backend], c, upconn, entry);
+	pp->nidle[c->backend]--;
+	upconn_close(c);
+}
+
+void
+upconn_event(int fd, short what, void *arg)
+{
+	struct upconn *c = arg;
+
+	(void)fd;
+	(void)what;
+	if (c->state == UPCONN_IDLE)
+		upconn_expire(c);
+	else if (c->req->is_closed)
+		proxy_abandon(c);
+	else if (c->state == UPCONN_SENDING)
+		proxy_write(c);
+	else
+		proxy_read(c);
+}
+
+/* the backend's deadline passed */
+void
+upconn_timeout(void *arg)
+{
+	struct upconn *c = arg;
+
+	if (c->state == UPCONN_IDLE)
+		upconn_expire(c);
+	else if (c->req->is_closed)
+		proxy_abandon(c);
+	else
+		proxy_fail(c, HTTP_504);
+}
+
+/* the client's queue drained below the mark: take in more of the body */
+void
+proxy_update(struct request *req)
+{
+	struct upconn *c = req->upstream;
+
+	if (c != NULL && c->paused && req->outlen < req->cli.srv->out_highwat) {
+		c->paused = 0;
+		upconn_wait(c, EV_READ, UPSTREAM_TIMEOUT);
+	}
+}
+
+/* whether sending a request twice is as good as once (RFC 9110, 9.2.2) */
+int
+method_idempotent(const char *m, size_t len)
+{
+	static const char *const methods[] = {
+		"GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+		if (strlen(methods[i]) == len && memcmp(methods[i], m, len) == 0)
+			return 1;
+	return 0;
+}
+
+/* a request under an upstream group's prefix, passed to its least busy backend */
+void
+route_proxy(struct request *req, const struct route_params *rp, void *arg)
+{
+	const struct upstream *up = arg;
+	struct reqbuf *in = req->in;
+	char *out;
+	size_t len;
+	int b;
+
+	(void)rp;
+	b = upstream_pick(up, &req->cli.srv->proxies[up->id].load);
+	if ((out = proxy_request(req, up, b, &len)) == NULL) {
+		request_error(req, HTTP_500);
+		return;
+	}
+	if (proxy_send(req, up, b, out, len,
+	    method_idempotent(in->method, in->methodlen), 0) == -1) {
+		free(out);
+		request_error(req, HTTP_502);
+		return;
+	}
+	req->cli.srv->stats.proxied++;
+}
+
+/* the routes every worker serves, built before they start */
+struct router *
+server_routes(struct server *srv)
+{
+	struct router *r;
+	int i;
+
+	if ((r = router_create()) == NULL ||
+	    router_add(r, "GET", STATUS_PATH, route_status, NULL) == -1 ||
+	    router_add(r, "HEAD", STATUS_PATH, route_status, NULL) == -1)
+		return NULL;
+	for (i = 0; i < srv->nupstreams; i++)
+		if (router_add(r, NULL, srv->upstreams[i].pattern, route_proxy,
+		    &srv->upstreams[i]) == -1)
+			return NULL;
+	if (router_add(r, "GET", "/*", route_static, NULL) == -1 ||
+	    router_add(r, "HEAD", "/*", route_static, NULL) == -1)
+		return NULL;
+	return r;
+}
+
+/* hand a parsed request to the handler of its route */
+void
+request_route(struct request *req)
+{
+	struct server *srv = req->cli.srv;
+	struct reqbuf *in = req->in;
+	const struct route *rt;
+	struct route_params rp;
+	struct response res;
+	char path[PATH_MAX], allow[64];
+	int found, len;
+
+	/* route what the path means, not how it is spelt */
+	if ((len = target_normalize(in->path, in->pathlen, path,
+	    sizeof(path))) == -1) {
+		request_error(req, HTTP_400);
+		return;
+	}
+	in->target = path;
+	in->targetlen = len;
+	if ((rt = router_match(srv->router, in->method, in->methodlen,
+	    path, len, &rp, &found)) == NULL) {
+		if (!found) {
+			request_error(req, HTTP_404);
+			return;
+		}
+		router_allow(srv->router, path, len, allow, sizeof(allow));
+		response_error(&res, req->minor_version, HTTP_405);
+		response_header(&res, "Allow", allow);
+		response_send(&res, req);
+		return;
+	}
+	rt->handler(req, &rp, rt->arg);
+}
+
+/*
+ * Map a header name to its HTTP_HEADER. The length alone tells the
+ * known names apart but for one pair, so this is a perfect hash that
+ * needs a single compare to confirm.
+ */
+HTTP_HEADER
+header_lookup(const char *name, size_t len)
+{
+	HTTP_HEADER h;
+
+	switch (len) {
+	case 4:
+		h = HDR_HOST;
+		break;
+	case 5:
+		h = HDR_RANGE;
+		break;
+	case 6:
+		h = HDR_EXPECT;
+		break;
+	case 8:
+		h = HDR_IF_RANGE;
+		break;
+	case 10:
+		h = HDR_CONNECTION;
+		break;
+	case 13:
+		h = HDR_IF_NONE_MATCH;
+		break;
+	case 14:
+		h = HDR_CONTENT_LENGTH;
+		break;
+	case 15:
+		h = HDR_ACCEPT_ENCODING;
+		break;
+	case 17:
+		h = (name[0] | 0x20) == 'i' ?
+		    HDR_IF_MODIFIED_SINCE : HDR_TRANSFER_ENCODING;
+		break;
+	default:
+		return HDR_UNKNOWN;
+	}
+	return strncasecmp(name, http_header_string[h], len) == 0 ?
+	    h : HDR_UNKNOWN;
+}
+
+/* fill the known header slots from a freshly parsed head */
+void
+request_index_headers(struct request *req)
+{
+	struct reqbuf *in = req->in;
+	HTTP_HEADER h;
+	size_t i;
+
+	memset(in->known, 0, sizeof(in->known));
+	for (i = 0; i < in->nheaders; i++) {
+		/* continuation lines have no name */
+		if (in->headers[i].name == NULL)
+			continue;
+		h = header_lookup(in->headers[i].name, in->headers[i].name_len);
+		if (h != HDR_UNKNOWN && in->known[h] == NULL)
+			in->known[h] = &in->headers[i];
+	}
+}
+
+/*
+ * HTTP/1.1 connections persist unless the client sends
+ * "Connection: close"; HTTP/1.0 ones only with "Connection: keep-alive".
+ */
+int
+request_keepalive(struct request *req)
+{
+	const struct phr_header *h = req->in->known[HDR_CONNECTION];
+
+	/* a list of options, e.g. "close, TE" */
+	if (header_has_token(h, "close"))
+		return 0;
+	if (header_has_token(h, "keep-alive"))
+		return 1;
+	return req->minor_version >= 1;
+}
+
+/*
+ * Length of the request body from Content-Length, 0 if there is none.
+ * Returns -1 for a malformed value or one that would overflow, and for
+ * several that disagree (RFC 9112, 6.3): the first alone would frame
+ * the body differently from whoever reads another.
+ */
+long long
+request_content_length(struct request *req)
+{
+	struct reqbuf *in = req->in;
+	const struct phr_header *h;
+	long long len = -1, n;
+	size_t i, j;
+
+	if ((h = in->known[HDR_CONTENT_LENGTH]) == NULL)
+		return 0;
+	for (i = h - in->headers; i < in->nheaders; i++) {
+		h = &in->headers[i];
+		if (h->name == NULL || header_lookup(h->name, h->name_len) !=
+		    HDR_CONTENT_LENGTH)
+			continue;
+		if (h->value_len == 0)
+			return -1;
+		for (n = 0, j = 0; j < h->value_len; j++) {
+			if (h->value[j] < '0' || h->value[j] > '9')
+				return -1;
+			if (n > (LLONG_MAX - 9) / 10)
+				return -1;
+			n = n * 10 + (h->value[j] - '0');
+		}
+		if (len != -1 && n != len)
+			return -1;
+		len = n;
+	}
+	return len;
+}
+
+/*
+ * An IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only form we
+ * send; returns -1 for anything else.
+ */
+time_t
+http_date_parse(const char *value, size_t len)
+{
+	char buf[64];
+	struct tm tm;
+	char *end;
+
+	if (len >= sizeof(buf))
+		return -1;
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if ((end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL ||
+	    *end != '\0')
+		return -1;
+	return timegm(&tm);
+}
+
+/* a decimal byte position; -1 if there is none or it overflows */
+off_t
+range_number(const char **pp, const char *end)
+{
+	const char *p = *pp;
+	long long n = 0;
+
+	if (p == end || *p < '0' || *p > '9')
+		return -1;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (n > (LLONG_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + (*p - '0');
+	}
+	*pp = p;
+	return n;
+}
+
+/*
+ * Parse the Range of a GET into rs. A server may ignore Range, so
+ * anything malformed, in another unit or with more than RANGES_MAX
+ * ranges leaves rs->n at 0 and the whole file is sent, as does an
+ * If-Range with a weak or overlong entity tag, which can't match.
+ */
+void
+request_ranges(struct request *req, struct ranges *rs)
+{
+	struct reqbuf *in = req->in;
+	struct phr_header *h;
+	struct byterange *r;
+	const char *p, *end;
+
+	rs->n = 0;
+	rs->if_range = -1;
+	rs->if_tag[0] = '\0';
+	if ((h = in->known[HDR_RANGE]) == NULL || in->methodlen != 3 ||
+	    memcmp(in->method, "GET", 3) != 0)
+		return;
+	if ((p = h->value) + 6 > (end = h->value + h->value_len) ||
+	    strncasecmp(p, "bytes=", 6) != 0)
+		return;
+	for (p += 6;;) {
+		/* empty list elements are allowed and skipped */
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (rs->n == RANGES_MAX)
+			goto ignore;
+		r = &rs->r[rs->n];
+		r->first = -1;
+		if (*p != '-' && (r->first = range_number(&p, end)) == -1)
+			goto ignore;
+		if (p == end || *p++ != '-')
+			goto ignore;
+		r->last = -1;
+		if (p < end && *p >= '0' && *p <= '9' &&
+		    (r->last = range_number(&p, end)) == -1)
+			goto ignore;
+		if ((r->first == -1 && r->last == -1) ||
+		    (r->last != -1 && r->last < r->first))
+			goto ignore;
+		rs->n++;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p < end && *p != ',')
+			goto ignore;
+	}
+
+	if ((h = in->known[HDR_IF_RANGE]) == NULL)
+		return;
+	if (h->value_len > 0 && h->value[0] == '"') {
+		if (h->value_len >= sizeof(rs->if_tag))
+			goto ignore;
+		memcpy(rs->if_tag, h->value, h->value_len);
+		rs->if_tag[h->value_len] = '\0';
+	} else if ((rs->if_range = http_date_parse(h->value,
+	    h->value_len)) == -1)
+		goto ignore;
+	return;
+
+ignore:
+	rs->n = 0;
+}
+
+/*
+ * Copy the preconditions of a GET or HEAD into pc. An If-None-Match too
+ * long to copy or an unparsable If-Modified-Since is ignored, which
+ * only costs a full response.
+ */
+void
+request_preconds(struct request *req, struct preconds *pc)
+{
+	struct reqbuf *in = req->in;
+	struct phr_header *h;
+
+	pc->modified_since = -1;
+	pc->none_match[0] = '\0';
+	if (!(in->methodlen == 3 && memcmp(in->method, "GET", 3) == 0) &&
+	    !(in->methodlen == 4 && memcmp(in->method, "HEAD", 4) == 0))
+		return;
+	if ((h = in->known[HDR_IF_NONE_MATCH]) != NULL) {
+		if (h->value_len > 0 && h->value_len < sizeof(pc->none_match)) {
+			memcpy(pc->none_match, h->value, h->value_len);
+			pc->none_match[h->value_len] = '\0';
+		}
+		return;		/* If-Modified-Since no longer applies */
+	}
+	if ((h = in->known[HDR_IF_MODIFIED_SINCE]) != NULL)
+		pc->modified_since = http_date_parse(h->value, h->value_len);
+}
+
+int
+hexdigit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+		return (c | 0x20) - 'a' + 10;
+	return -1;
+}
+
+/* a byte an URI needn't percent-encode (RFC 3986, 2.3) */
+int
+uri_unreserved(int c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	    (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+	    c == '~';
+}
+
+/*
+ * The path of a request target in its normal form (RFC 3986, 6.2.2):
+ * escapes of unreserved bytes decoded and the rest in upper case, "."
+ * and ".." segments resolved and empty ones dropped. Unlike
+ * path_normalize() it keeps an escaped "/" a byte of its segment, and a
+ * trailing "/". A query or a fragment ends it. Its length, or -1 if the
+ * target isn't a path, climbs above the root or doesn't fit.
+ */
+int
+target_normalize(const char *target, size_t tlen, char *buf, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const char *p = target, *end = target + tlen;
+	size_t n = 1, seg = 1;	/* bytes out, where this segment starts */
+	int c, hi, lo, last;
+
+	if (p == end || *p++ != '/' || len < 2)
+		return -1;
+	buf[0] = '/';
+	for (;;) {
+		last = p == end || *p == '?' || *p == '#';
+		if (!last) {
+			if ((c = (unsigned char)*p++) == '%') {
+				if (end - p < 2 || (hi = hexdigit(p[0])) == -1 ||
+				    (lo = hexdigit(p[1])) == -1)
+					return -1;
+				p += 2;
+				if (!uri_unreserved(c = hi << 4 | lo)) {
+					if (n + 3 >= len)
+						return -1;
+					buf[n++] = '%';
+					buf[n++] = hex[hi];
+					buf[n++] = hex[lo];
+					continue;
+				}
+			}
+			if (c != '/') {
+				if (n + 1 >= len)
+					return -1;
+				buf[n++] = c;
+				continue;
+			}
+		}
+		/* a segment ended: buf[seg] up to n */
+		if (n - seg == 2 && buf[seg] == '.' && buf[seg + 1] == '.') {
+			if (seg == 1)
+				return -1;
+			for (n = seg - 1; buf[n - 1] != '/'; n--)
+				; /* empty */
+			seg = n;
+		} else if (n - seg == 1 && buf[seg] == '.')
+			n = seg;
+		else if (n > seg && !last) {
+			if (n + 1 >= len)
+				return -1;
+			buf[n++] = '/';
+			seg = n;
+		}
+		if (last)
+			break;
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Percent-decode the path of a request target and resolve its "." and
+ * ".." segments in the same pass, into a path relative to the root with
+ * no empty segments; a directory gets its index file. A query or a
+ * fragment ends it. -1 if the target isn't a path, climbs above the
+ * root, holds a NUL or an escaped "/" or doesn't fit: the router takes
+ * the latter for part of a segment, so it can't be a separator here.
+ */
+int
+path_normalize(const char *target, size_t tlen, char *buf, size_t len)
+{
+	const char *p = target, *end = target + tlen;
+	size_t n = 0, seg = 0;	/* bytes out, where this segment starts */
+	int c, hi, lo, last;
+
+	if (p == end || *p++ != '/')
+		return -1;
+	for (;;) {
+		last = p == end || *p == '?' || *p == '#';
+		if (!last) {
+			if ((c = (unsigned char)*p++) == '%') {
+				if (end - p < 2 || (hi = hexdigit(p[0])) == -1 ||
+				    (lo = hexdigit(p[1])) == -1 ||
+				    (c = hi << 4 | lo) == '\0' || c == '/')
+					return -1;
+				p += 2;
+			}
+			if (c != '/') {
+				if (n + 1 >= len)
+					return -1;
+				buf[n++] = c;
+				continue;
+			}
+		}
+		/* a segment ended: buf[seg] up to n */
+		if (n - seg == 2 && buf[seg] == '.' && buf[seg + 1] == '.') {
+			if (seg == 0)
+				return -1;
+			for (n = seg - 1; n > 0 && buf[n - 1] != '/'; n--)
+				; /* empty */
+			seg = n;
+		} else if (n - seg == 1 && buf[seg] == '.')
+			n = seg;
+		else if (n > seg && !last) {
+			if (n + 1 >= len)
+				return -1;
+			buf[n++] = '/';
+			seg = n;
+		}
+		if (last)
+			break;
+	}
+	if (n == 0 || buf[n - 1] == '/') {
+		if (n + sizeof(INDEX_FILE) > len)
+			return -1;
+		memcpy(buf + n, INDEX_FILE, sizeof(INDEX_FILE));
+		return 0;
+	}
+	buf[n] = '\0';
+	return 0;
+}
+
+/* whether a q parameter, at p, says "not acceptable" */
+int
+qvalue_zero(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == ';'))
+		p++;
+	if (end - p < 3 || strncasecmp(p, "q=", 2) != 0)
+		return 0;
+	for (p += 2; p < end && (*p == '0' || *p == '.'); p++)
+		; /* empty */
+	return p == end || *p == ' ' || *p == '\t' || *p == ';';
+}
+
+/*
+ * The content codings the client takes: each one Accept-Encoding names,
+ * or that "*" covers, unless it has q=0. Identity is always taken.
+ */
+int
+request_encodings(struct request *req)
+{
+	struct phr_header *h;
+	const char *p, *end, *elem, *tok;
+	int encs = 1 << ENC_IDENTITY, named = 0, star = 0, bit;
+	size_t len;
+
+	if ((h = req->in->known[HDR_ACCEPT_ENCODING]) == NULL)
+		return encs;
+	for (p = h->value, end = p + h->value_len; p < end; p = elem + 1) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if ((elem = memchr(p, ',', end - p)) == NULL)
+			elem = end;
+		for (tok = p; tok < elem && *tok != ';' && *tok != ' ' &&
+		    *tok != '\t'; tok++)
+			; /* empty */
+		len = tok - p;
+		if (len == 2 && strncasecmp(p, "br", 2) == 0)
+			bit = 1 << ENC_BR;
+		else if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+		    (len == 6 && strncasecmp(p, "x-gzip", 6) == 0))
+			bit = 1 << ENC_GZIP;
+		else if (len == 1 && *p == '*') {
+			star = !qvalue_zero(tok, elem);
+			continue;
+		} else
+			continue;
+		named |= bit;
+		if (!qvalue_zero(tok, elem))
+			encs |= bit;
+	}
+	if (star)
+		encs |= ((1 << ENC_BR) | (1 << ENC_GZIP)) & ~named;
+	return encs;
+}
+
+/* arm the client event for `what', unless it is already armed for it */
+int
+request_wait(struct request *req, short what)
+{
+	if (req->cli.srv->engine == ENGINE_URING) {
+		req->evwhat = what;
+		if (request_recv(req, what & EV_READ) == -1)
+			return -1;
+		if ((what & EV_WRITE) && request_send(req) == -1)
+			return -1;
+		return 0;
+	}
+	if (req->evwhat == what)
+		return 0;
+	if (req->evwhat != 0)
+		event_del(&req->cli.ev);
+	req->evwhat = 0;
+	if (what == 0)
+		return 0;
+	server_event_set(req->cli.srv, &req->cli.ev, req->cli.fd,
+	    what|EV_PERSIST, client_event, (void *)slab_handle(requests, req));
+	if (event_add(&req->cli.ev, NULL) == -1)
+		return -1;
+	req->evwhat = what;
+	return 0;
+}
+
+/*
+ * Pick the deadline for what the connection is waiting on. A head must
+ * arrive whole within HEADER_TIMEOUT of its first byte, however slowly
+ * it trickles in; the other deadlines restart whenever bytes move.
+ */
+void
+request_deadline(struct request *req)
+{
+	struct reqbuf *in = req->in;
+	int timeout, secs, refresh = 1;
+
+	if (req->upstream != NULL && TAILQ_EMPTY(&req->outq)) {
+		/* the backend's own deadline comes first and answers 504 */
+		timeout = TIMEOUT_UPSTREAM;
+		secs = UPSTREAM_TIMEOUT + 1;
+	} else if (!TAILQ_EMPTY(&req->outq) || req->waiting) {
+		/* a file still being opened is output on its way */
+		timeout = TIMEOUT_WRITE;
+		secs = WRITE_TIMEOUT;
+	} else if (in != NULL && in->buflen > 0 && !req->draining) {
+		if (in->body) {
+			timeout = TIMEOUT_BODY;
+			secs = BODY_TIMEOUT;
+		} else {
+			timeout = TIMEOUT_HEADER;
+			secs = HEADER_TIMEOUT;
+			refresh = 0;
+		}
+	} else {
+		timeout = TIMEOUT_IDLE;
+		secs = IDLE_TIMEOUT;
+	}
+
+	if (timeout != req->timeout || (refresh && req->progress))
+		timer_set(&req->cli.srv->timers, &req->timer, secs * 1000);
+	req->timeout = timeout;
+	req->progress = 0;
+}
+
+/*
+ * Answer a request we refuse to process and close the connection once
+ * the error is out; whatever else is buffered can't be trusted.
+ */
+void
+client_reject(struct request *req, HTTP_STATUS status)
+{
+	server_log(req->cli.srv, "rejecting request: %s",
+	    http_status_string[status]);
+	req->keepalive = 0;
+	req->closing = 1;
+	req->linger = 1;
+	request_error(req, status);
+}
+
+/*
+ * Parse and answer the requests sitting in the input buffer in order.
+ * Pipelined requests are handled back-to-back until the buffer runs
+ * dry, the output queue reaches its high-water mark or a response
+ * waits for the disk pool. Returns the number of requests answered.
+ */
+int
+client_process(struct request *req)
+{
+	struct server *srv = req->cli.srv;
+	struct reqbuf *in = req->in;
+	long long bodylen;
+	size_t off = 0, reqlen;
+	int ret, handled = 0;
+	unsigned i;
+
+	if (in == NULL)
+		return 0;
+	while (off < in->buflen && !req->closing && !req->waiting &&
+	    req->outlen < srv->out_highwat) {
+		/*
+		 * The parser can't resume past the end of a head, so one
+		 * waiting for its body is parsed again only once it is in.
+		 */
+		if (in->body && in->buflen - off < in->reqlen)
+			break;
+		in->nheaders = sizeof(in->headers) / sizeof(in->headers[0]);
+		ret = phr_parse_request(in->buf + off, in->buflen - off,
+					&in->method, &in->methodlen,
+					&in->path, &in->pathlen,
+					&req->minor_version,
+					in->headers, &in->nheaders, in->parsed);
+		/* even a refusal of a HEAD request goes without a body */
+		req->head = ret > 0 && in->methodlen == 4 &&
+		    memcmp(in->method, "HEAD", 4) == 0;
+		if (ret == -2) {
+			if (in->buflen - off >= srv->max_header_size)
+				client_reject(req, HTTP_431);
+			else
+				in->parsed = in->buflen - off;
+			break;
+		}
+		if (ret == -1) {
+			client_reject(req, HTTP_400);
+			break;
+		}
+		request_index_headers(req);
+
+		if (in->known[HDR_TRANSFER_ENCODING] != NULL) {
+			client_reject(req, HTTP_501);
+			break;
+		}
+		if ((bodylen = request_content_length(req)) == -1) {
+			client_reject(req, HTTP_400);
+			break;
+		}
+		if ((unsigned long long)bodylen > srv->max_body_size) {
+			client_reject(req, HTTP_413);
+			break;
+		}
+		if (in->buflen - off < (size_t)ret + (size_t)bodylen) {
+			/* head is complete, wait for the rest of the body */
+			in->parsed = 0;
+			in->body = 1;
+			in->reqlen = ret + bodylen;
+			break;
+		}
+		reqlen = ret + bodylen;
+		req->keepalive = request_keepalive(req);
+
+		log_debug("request is %d bytes long", ret);
+		log_debug("method is is %.*s",
+			   (int)in->methodlen, in->method);
+		log_debug("path is %.*s",
+			   (int)in->pathlen, in->path);
+		log_debug("HTTP version is 1.%d",
+			   (int)req->minor_version);
+		for (i = 0; i != in->nheaders; ++i)
+			log_debug("%.*s: %.*s",
+				   (int)in->headers[i].name_len,
+				   in->headers[i].name,
+				    (int)in->headers[i].value_len,
+				   in->headers[i].value); 
+		in->content = in->buf + off + ret;
+		in->contentlen = bodylen;
+		request_route(req);
+
+		if (!req->keepalive)
+			req->closing = 1;
+		off += reqlen;
+		in->parsed = 0;
+		in->body = 0;
+		req->timeout = TIMEOUT_NONE;
+		handled++;
+	}
+
+	if (off > 0) {
+		in->buflen -= off;
+		memmove(in->buf, in->buf + off, in->buflen);
+	}
+	return handled;
+}
+
+/*
+ * Double the input buffer, up to the largest head plus body we accept.
+ * client_process() rejects anything bigger before the cap is reached.
+ */
+int
+request_grow(struct request *req)
+{
+	struct server *srv = req->cli.srv;
+	struct reqbuf *in = req->in;
+	size_t limit = srv->max_header_size + srv->max_body_size;
+	size_t size;
+	char *buf;
+
+	size = in->bufsize == 0 ? BUF_INITIAL : in->bufsize * 2;
+	size = MINIMUM(size, limit);
+	if (size <= in->bufsize)
+		return -1;
+	if ((buf = realloc(in->buf, size)) == NULL)
+		return -1;
+	srv->in_mem += size - in->bufsize;
+	in->buf = buf;
+	in->bufsize = size;
+	return 0;
+}
+
+/* returns -1 if the connection had to be closed */
+int
+client_read(struct request *req)
+{
+	struct reqbuf *in;
+	ssize_t ret;
+
+	log_debug("starting read");
+
+	if (req->in == NULL && request_borrow(req) == -1) {
+		request_close(req);
+		return -1;
+	}
+	in = req->in;
+	if (req->draining)
+		in->buflen = 0;
+	if (in->buflen == in->bufsize && request_grow(req) == -1) {
+		request_close(req);
+		return -1;
+	}
+
+	while ((ret = read(req->cli.fd, in->buf + in->buflen,
+	    in->bufsize - in->buflen)) == -1 && errno == EINTR)
+		; /* empty */
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		request_close(req);
+		return -1;
+	}
+	if (ret == 0)
+		req->eof = 1;
+	else
+		req->progress = 1;
+	in->buflen += ret;
+	return 0;
+}
+
+/*
+ * Arm the client event for whatever the connection needs next:
+ * EV_WRITE while output is queued, EV_READ unless the queue is past its
+ * high-water mark, a response waits for the disk pool or no further
+ * requests will be read. Once the queue is empty on a connection that
+ * is done, close it.
+ */
+void
+client_update(struct request *req)
+{
+	struct server *srv = req->cli.srv;
+	short what = 0;
+
+	if (TAILQ_EMPTY(&req->outq) && !req->waiting &&
+	    (req->closing || req->eof)) {
+		if (req->eof || !req->linger) {
+			request_close(req);
+			return;
+		}
+		if (!req->draining) {
+			/*
+			 * Closing with unread input would reset the
+			 * connection and could destroy the error response
+			 * in flight, so half-close and drain until the
+			 * client hangs up.
+			 */
+			shutdown(req->cli.fd, SHUT_WR);
+			req->draining = 1;
+		}
+	}
+
+	if (!TAILQ_EMPTY(&req->outq))
+		what |= EV_WRITE;
+	if (req->draining ||
+	    (!req->closing && !req->eof && !req->waiting &&
+	    req->outlen < srv->out_highwat))
+		what |= EV_READ;
+	if (request_wait(req, what) == -1) {
+		request_close(req);
+		return;
+	}
+	proxy_update(req);
+	request_deadline(req);
+}
+
+/*
+ * Flush, then answer whatever the queue has room for; keep going
+ * while the socket takes everything we produce.
+ */
+void
+client_run(struct request *req)
+{
+	int handled, ret;
+
+	do {
+		if ((ret = request_flush(req)) == -1) {
+			request_close(req);
+			return;
+		}
+		handled = client_process(req);
+	} while (ret == 1 && handled > 0);
+
+	/* nothing left half-read: go back to holding no buffers */
+	if (req->in != NULL && req->in->buflen == 0)
+		request_return(req);
+	client_update(req);
+}
+
+void
+client_event(int fd, short what, void *arg)
+{
+	struct request *req;
+
+	(void)fd;
+	if ((req = slab_lookup(requests, (uintptr_t)arg)) == NULL) {
+		log_debug("event for a closed connection");
+		return;
+	}
+	if ((what & EV_READ) && client_read(req) == -1)
+		return;
+	client_run(req);
+}
+
+/* the last completion for a closed connection frees it */
+int
+client_done(struct request *req)
+{
+	req->inflight--;
+	if (!req->is_closed)
+		return 0;
+	if (req->inflight == 0)
+		request_free(req);
+	return 1;
+}
+
+/*
+ * Copy received bytes into the parse buffer, as client_read() would
+ * have read them. Returns -1 if they don't fit.
+ */
+int
+client_append(struct request *req, const char *buf, size_t len)
+{
+	struct reqbuf *in;
+	size_t n;
+
+	if (req->in == NULL && request_borrow(req) == -1)
+		return -1;
+	in = req->in;
+	req->progress = 1;
+	if (req->draining) {
+		in->buflen = 0;
+		return 0;
+	}
+	while (len > 0) {
+		if (in->buflen == in->bufsize && request_grow(req) == -1)
+			return -1;
+		n = MINIMUM(len, in->bufsize - in->buflen);
+		memcpy(in->buf + in->buflen, buf, n);
+		in->buflen += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* a multishot receive completed, possibly for the last time */
+void
+client_recv(struct request *req, int res, unsigned int flags)
+{
+	struct uring_bufs *rbufs = &req->cli.srv->rbufs;
+	unsigned int bid;
+	int error = 0;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res > 0 && !req->is_closed)
+			error = client_append(req, uring_buf(rbufs, bid), res);
+		uring_buf_recycle(rbufs, bid);
+	}
+	if (!(flags & IORING_CQE_F_MORE)) {
+		req->reading = 0;
+		req->unreading = 0;
+		if (client_done(req))
+			return;
+	} else if (req->is_closed)
+		return;
+
+	/* out of ring buffers or cancelled: rearmed below if still wanted */
+	if (res == 0)
+		req->eof = 1;
+	else if (error || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+		request_close(req);
+		return;
+	}
+	client_run(req);
+}
+
+/* a run of memory buffers went out */
+void
+client_sent(struct request *req, int res)
+{
+	struct outbuf *ob;
+	size_t n, len;
+
+	req->sending--;
+	if (client_done(req))
+		return;
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		request_close(req);
+		return;
+	}
+	n = res > 0 ? res : 0;
+	req->outlen -= n;
+	if (n > 0)
+		req->progress = 1;
+	while (n > 0) {
+		ob = TAILQ_FIRST(&req->outq);
+		len = ob->end - ob->off;
+		if (n < len) {
+			ob->off += n;
+			break;
+		}
+		n -= len;
+		TAILQ_REMOVE(&req->outq, ob, entry);
+		outbuf_free(req->cli.srv, ob);
+	}
+	client_run(req);
+}
+
+/* one link of a request_splice() chain completed */
+void
+client_spliced(struct request *req, int op, int res)
+{
+	struct outbuf *ob = TAILQ_FIRST(&req->outq);
+
+	req->sending--;
+	if (client_done(req))
+		return;
+	if (op == URING_SPLICE_IN) {
+		if (res <= 0) {		/* 0: the file shrank underneath us */
+			request_close(req);
+			return;
+		}
+		ob->off += res;
+		req->pipelen += res;
+	} else if (op == URING_SPLICE_OUT && res > 0) {
+		req->pipelen -= res;
+		req->outlen -= res;
+		req->progress = 1;
+	} else if (op == URING_SPLICE_OUT && res < 0 && res != -ECANCELED &&
+	    res != -EAGAIN && res != -EINTR) {
+		request_close(req);
+		return;
+	}
+	if (req->sending > 0)
+		return;
+	if (ob->off == ob->end && req->pipelen == 0) {
+		TAILQ_REMOVE(&req->outq, ob, entry);
+		outbuf_free(req->cli.srv, ob);
+	}
+	client_run(req);
+}
+
+/* the connection's deadline passed */
+void
+client_timeout(void *arg)
+{
+	struct request *req = arg;
+
+	log_debug("request timed out");
+	request_close(req);
+}
+
+void server_uring_accept(struct server *);
+
+void
+server_accept_resume(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+
+	(void)fd;
+	(void)what;
+	if (srv->engine == ENGINE_URING)
+		server_uring_accept(srv);
+	else
+		event_add(&srv->ev, 0);
+}
+
+/*
+ * Out of descriptors: the pending connection stays queued and the
+ * socket stays readable, so stop polling it for a moment instead of
+ * spinning on EMFILE.
+ */
+void
+server_accept_pause(struct server *srv)
+{
+	struct timeval tv = { ACCEPT_PAUSE, 0 };
+
+	if (srv->engine == ENGINE_LIBEVENT)
+		event_del(&srv->ev);
+	server_event_set(srv, &srv->pause_ev, -1, 0, server_accept_resume, srv);
+	evtimer_add(&srv->pause_ev, &tv);
+}
+
+/* take on an accepted connection */
+void
+server_client(struct server *srv, int cfd, const struct sockaddr_in *addr)
+{
+	struct request *req;
+
+	srv->stats.accepted++;
+	if ((req = slab_alloc(requests)) == NULL) {
+		close(cfd);
+		return;
+	}
+	request_init(req);
+	req->cli.fd = cfd;
+	req->cli.addr = *addr;
+	req->cli.srv = srv;
+	if (srv->engine == ENGINE_URING)
+		request_fix(req);
+
+	if (request_wait(req, EV_READ) == -1) {
+		server_log(srv, "error adding client event");
+		request_close(req);
+		return;
+	}
+	request_deadline(req);
+}
+
+/*
+ * Drain up to ACCEPT_BATCH connections per wakeup. A full batch means
+ * the accept queue was still backed up when we stopped, so note how
+ * deep it was.
+ */
+void
+server_accept(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+	struct sockaddr_in addr;
+	struct tcp_info ti;
+	socklen_t len;
+	int cfd, n;
+
+	(void)what;
+	for (n = 0; n < ACCEPT_BATCH; n++) {
+		len = sizeof(addr);
+		cfd = accept4(fd, (struct sockaddr *)&addr, &len,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			srv->stats.accept_errors++;
+			server_log(srv, "accept4: %s", strerror(errno));
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM)
+				server_accept_pause(srv);
+			break;
+		}
+		server_client(srv, cfd, &addr);
+	}
+
+	if (n == ACCEPT_BATCH) {
+		srv->stats.accept_full++;
+		/* on a listener, tcpi_unacked is the accept queue length */
+		len = sizeof(ti);
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+		    ti.tcpi_unacked > srv->stats.queue_max)
+			srv->stats.queue_max = ti.tcpi_unacked;
+	}
+}
+
+/*
+ * Accept connections with one multishot submission that keeps posting
+ * a completion per connection. io_uring already polls the listener
+ * exclusively, so every listen mode works the same way here.
+ */
+void
+server_uring_accept(struct server *srv)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(&srv->ring)) == NULL) {
+		server_log(srv, "io_uring submission queue full");
+		server_accept_pause(srv);
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = srv->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = (uint64_t)URING_ACCEPT << URING_OP_SHIFT;
+}
+
+void
+server_accepted(struct server *srv, int res, unsigned int flags)
+{
+	struct sockaddr_in addr;
+
+	if (res >= 0) {
+		/*
+		 * Multishot accept has nowhere to put the peer address;
+		 * proxy_request() asks for it.
+		 */
+		memset(&addr, 0, sizeof(addr));
+		server_client(srv, res, &addr);
+	} else if (res != -ECONNABORTED && res != -EINTR) {
+		srv->stats.accept_errors++;
+		server_log(srv, "accept: %s", strerror(-res));
+	}
+	if (flags & IORING_CQE_F_MORE)
+		return;
+	if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS ||
+	    res == -ENOMEM)
+		server_accept_pause(srv);
+	else
+		server_uring_accept(srv);
+}
+
+/* reap every completion and hand it to its connection */
+void
+server_ring(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+	struct io_uring_cqe *cqe;
+	struct request *req;
+	uint64_t data;
+	unsigned int flags;
+	int op, res;
+
+	(void)fd;
+	(void)what;
+	while ((cqe = uring_cqe(&srv->ring)) != NULL) {
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		uring_cqe_seen(&srv->ring);
+
+		op = (data & URING_OP_MASK) >> URING_OP_SHIFT;
+		if (op == URING_ACCEPT) {
+			server_accepted(srv, res, flags);
+			continue;
+		}
+		if (op == URING_CANCEL || op == URING_UPDATE) {
+			/* only failures are reported */
+			log_debug("io_uring %s: %s", op == URING_CANCEL ?
+			    "cancel" : "files update", strerror(-res));
+			continue;
+		}
+		if ((req = slab_lookup(requests, data & ~URING_OP_MASK)) ==
+		    NULL) {
+			/* connections outlive their operations; can't happen */
+			log_debug("completion for a closed connection");
+			if (flags & IORING_CQE_F_BUFFER)
+				uring_buf_recycle(&srv->rbufs,
+				    flags >> IORING_CQE_BUFFER_SHIFT);
+			continue;
+		}
+		switch (op) {
+		case URING_RECV:
+			client_recv(req, res, flags);
+			break;
+		case URING_SEND:
+			client_sent(req, res);
+			break;
+		default:
+			client_spliced(req, op, res);
+			break;
+		}
+	}
+}
+
+/*
+ * Set up this worker's ring: receive buffers, a fixed file table for
+ * the sockets and the accept. Completions are reaped when the ring's
+ * descriptor turns readable in the libevent loop, which still runs
+ * the signals and timers; submissions go out once per iteration.
+ */
+int
+server_uring(struct server *srv)
+{
+	struct rlimit rl;
+	unsigned int n;
+	int error;
+
+	if (uring_init(&srv->ring, URING_ENTRIES) == -1)
+		return -1;
+	if ((srv->args = calloc(srv->ring.sq_entries,
+	    sizeof(*srv->args))) == NULL)
+		goto fail;
+	if (uring_bufs_init(&srv->ring, &srv->rbufs, 0, URING_BUFS,
+	    BUF_INITIAL) == -1)
+		goto fail;
+	srv->nfiles = 0;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		n = MINIMUM(rl.rlim_cur, URING_FILES);
+		if (uring_files(&srv->ring, n) == 0)
+			srv->nfiles = n;
+		else
+			server_log(srv, "io_uring fixed files: %s",
+			    strerror(errno));
+	}
+
+	server_event_set(srv, &srv->ring_ev, srv->ring.fd, EV_READ | EV_PERSIST,
+	    server_ring, srv);
+	if (event_add(&srv->ring_ev, NULL) == -1)
+		goto fail;
+	server_uring_accept(srv);
+	return 0;
+
+fail:
+	error = errno;
+	free(srv->args);
+	srv->args = NULL;
+	uring_free(&srv->ring);
+	errno = error;
+	return -1;
+}
+
+/*
+ * Read the kernel's accept queue overflow counters (ListenOverflows,
+ * ListenDrops) from the TcpExt section of /proc/net/netstat.
+ */
+int
+listen_overflows(unsigned long long *overflows, unsigned long long *drops)
+{
+	FILE *fp;
+	char names[4096], values[4096];
+	char *np, *vp, *n, *v;
+	int found = 0;
+
+	if ((fp = fopen("/proc/net/netstat", "r")) == NULL)
+		return -1;
+	while (fgets(names, sizeof(names), fp) != NULL &&
+	    fgets(values, sizeof(values), fp) != NULL) {
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+		n = strtok_r(names, " \n", &np);
+		v = strtok_r(values, " \n", &vp);
+		while ((n = strtok_r(NULL, " \n", &np)) != NULL &&
+		    (v = strtok_r(NULL, " \n", &vp)) != NULL) {
+			if (strcmp(n, "ListenOverflows") == 0) {
+				*overflows = strtoull(v, NULL, 10);
+				found++;
+			} else if (strcmp(n, "ListenDrops") == 0) {
+				*drops = strtoull(v, NULL, 10);
+				found++;
+			}
+		}
+		break;
+	}
+	fclose(fp);
+	return found == 2 ? 0 : -1;
+}
+
+/*
+ * What connections cost this worker: slab slots (live or free), parse
+ * buffers (lent or pooled) and queued output, and the average over the
+ * live connections.
+ */
+void
+server_memory(struct server *srv)
+{
+	struct slab_stats ss;
+	size_t total;
+
+	slab_stats(requests, &ss);
+	total = ss.bytes + srv->in_mem + srv->out_mem;
+	server_log(srv, "memory: %zu connections, %zu bytes each; "
+	    "slots %zu of %zu, parse buffers %zu bytes (%zu pooled), "
+	    "output %zu bytes", ss.inuse, ss.inuse ? total / ss.inuse : 0,
+	    ss.inuse, ss.capacity, srv->in_mem, srv->nreqbufs, srv->out_mem);
+}
+
+/*
+ * Periodic counters: workers report their accept and file cache
+ * statistics, the master reports the shared cache and the system-wide
+ * accept queue overflows.
+ */
+void
+server_stats(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+	struct accept_stats *st = &srv->stats;
+	struct timeval tv = { STATS_INTERVAL, 0 };
+	unsigned long long overflows, drops;
+	struct cache_stats cs;
+	struct fdcache_stats fs;
+	struct zcache_stats zs;
+
+	(void)fd;
+	(void)what;
+	evtimer_add(&srv->stats_ev, &tv);
+	if (srv->is_master) {
+		if (srv->cache != NULL) {
+			cache_stats(srv->cache, &cs);
+			if (cs.hits + cs.misses != st->cache_lookups) {
+				server_log(srv, "cache: %llu hits, %llu misses, "
+				    "%llu inserts, %llu evictions, %llu invalidations",
+				    (unsigned long long)cs.hits,
+				    (unsigned long long)cs.misses,
+				    (unsigned long long)cs.inserts,
+				    (unsigned long long)cs.evictions,
+				    (unsigned long long)cs.invalidations);
+				st->cache_lookups = cs.hits + cs.misses;
+			}
+		}
+		if (listen_overflows(&overflows, &drops) == 0 &&
+		    (overflows != st->overflows || drops != st->drops)) {
+			server_log(srv, "listen queue: %llu overflows, %llu drops",
+			    overflows - st->overflows, drops - st->drops);
+			st->overflows = overflows;
+			st->drops = drops;
+		}
+		return;
+	}
+	if (st->accepted != st->reported) {
+		server_log(srv, "accepted %llu, full batches %llu, "
+		    "max queue %u, errors %llu", st->accepted, st->accept_full,
+		    st->queue_max, st->accept_errors);
+		st->reported = st->accepted;
+		server_memory(srv);
+	}
+	if (st->offloaded != st->offloaded_reported) {
+		server_log(srv, "disk pool: %llu files opened",
+		    st->offloaded - st->offloaded_reported);
+		st->offloaded_reported = st->offloaded;
+	}
+	if (st->proxied != st->proxied_reported) {
+		server_log(srv, "upstreams: %llu requests proxied",
+		    st->proxied - st->proxied_reported);
+		st->proxied_reported = st->proxied;
+	}
+	if (srv->fdcache != NULL) {
+		fdcache_stats(srv->fdcache, &fs);
+		if (fs.hits + fs.negative_hits + fs.misses != st->fdcache_lookups) {
+			server_log(srv, "file cache: %llu hits, %llu negative hits, "
+			    "%llu misses, %llu invalidations",
+			    (unsigned long long)fs.hits,
+			    (unsigned long long)fs.negative_hits,
+			    (unsigned long long)fs.misses,
+			    (unsigned long long)fs.invalidations);
+			st->fdcache_lookups = fs.hits + fs.negative_hits + fs.misses;
+		}
+	}
+	/* a process's threads share one, so only the first reports it */
+	if (srv->zcache != NULL && (!srv->threaded || srv->id == 0)) {
+		zcache_stats(srv->zcache, &zs);
+		if (zs.hits + zs.misses != st->zcache_lookups) {
+			server_log(srv, "compression cache: %llu hits, "
+			    "%llu misses, %llu fills, %llu evictions, %zu bytes",
+			    (unsigned long long)zs.hits,
+			    (unsigned long long)zs.misses,
+			    (unsigned long long)zs.fills,
+			    (unsigned long long)zs.evictions, zs.bytes);
+			st->zcache_lookups = zs.hits + zs.misses;
+		}
+	}
+}
+
+void
+server_stats_start(struct server *srv)
+{
+	struct timeval tv = { STATS_INTERVAL, 0 };
+
+	memset(&srv->stats, 0, sizeof(srv->stats));
+	if (srv->is_master)
+		listen_overflows(&srv->stats.overflows, &srv->stats.drops);
+	server_event_set(srv, &srv->stats_ev, -1, 0, server_stats, srv);
+	evtimer_add(&srv->stats_ev, &tv);
+}
+
+/* the kernel caps the backlog at net.core.somaxconn, so ask for that */
+int
+default_backlog(void)
+{
+	FILE *fp;
+	int n = 0;
+
+	if ((fp = fopen("/proc/sys/net/core/somaxconn", "r")) != NULL) {
+		if (fscanf(fp, "%d", &n) != 1)
+			n = 0;
+		fclose(fp);
+	}
+	return n > 0 ? n : SOMAXCONN;
+}
+
+/* workers exit on SIGTERM once their log is written out */
+void
+worker_shutdown(int sig, short event, void *arg)
+{
+	struct server *srv = arg;
+
+	(void)sig;
+	(void)event;
+	server_log(srv, "exiting");
+	log_close();
+	exit(0);
+}
+
+/*
+ * With -S each worker is pinned to a CPU and the reuseport group gets a
+ * classic BPF program that picks the socket by the CPU the connection
+ * arrived on, so a connection is accepted by the worker running where
+ * its softirq ran. The program's result indexes the group in bind
+ * order, which is worker order.
+ */
+int
+server_steer(int fd, int nworkers)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nworkers },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog));
+}
+
+int
+server_listen(int reuseport, int backlog)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	setnonblock(fd);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+		close(fd);
+		return -2;
+	}
+		
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT_NO);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+		
+	if (listen(fd, backlog) == -1) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * LISTEN_EXCLUSIVE: each worker watches the shared socket through a
+ * private epoll set registered with EPOLLEXCLUSIVE, so the kernel wakes
+ * one worker per connection instead of all of them. libevent only sees
+ * the private epoll fd.
+ */
+void
+server_accept_exclusive(int efd, short what, void *arg)
+{
+	struct server *srv = arg;
+	struct epoll_event ev;
+
+	if (epoll_wait(efd, &ev, 1, 0) == 1)
+		server_accept(srv->fd, what, srv);
+}
+
+int
+server_exclusive(struct server *srv)
+{
+	struct epoll_event ev;
+
+	if ((srv->efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return -1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	if (epoll_ctl(srv->efd, EPOLL_CTL_ADD, srv->fd, &ev) == -1) {
+		close(srv->efd);
+		return -1;
+	}
+	server_event_set(srv, &srv->ev, srv->efd, EV_READ | EV_PERSIST,
+	    server_accept_exclusive, srv);
+	return 0;
+}
+
+/* a file changed on disk: whatever the shared cache holds for it is stale */
+void
+server_invalidate(const char *path, void *arg)
+{
+	struct server *srv = arg;
+
+	if (srv->cache != NULL)
+		cache_invalidate(srv->cache, path);
+}
+
+void
+server_notify(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+
+	(void)fd;
+	(void)what;
+	fdcache_notify(srv->fdcache, server_invalidate, srv);
+}
+
+void
+server_fdcache(struct server *srv)
+{
+	int fd;
+
+	if ((srv->fdcache = fdcache_create(FDCACHE_SIZE, FDCACHE_TTL)) == NULL) {
+		server_log(srv, "file cache disabled: %s", strerror(errno));
+		return;
+	}
+	if ((fd = fdcache_notify_fd(srv->fdcache)) == -1) {
+		server_log(srv, "inotify unavailable, file cache relies on TTL");
+		return;
+	}
+	server_event_set(srv, &srv->notify_ev, fd, EV_READ | EV_PERSIST,
+	    server_notify, srv);
+	event_add(&srv->notify_ev, NULL);
+}
+
+void
+server_disk(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+
+	(void)fd;
+	(void)what;
+	pool_cq_drain(&srv->diskq, disk_done, srv);
+}
+
+/*
+ * Start the process's disk pool unless the master already has, and
+ * give this worker its own queue of finished opens.
+ */
+void
+server_pool(struct server *srv)
+{
+	if (srv->disk_threads == 0)
+		return;
+	if (srv->pool == NULL &&
+	    (srv->pool = pool_create(srv->disk_threads)) == NULL) {
+		server_log(srv, "disk pool disabled: %s", strerror(errno));
+		return;
+	}
+	if (pool_cq_init(&srv->diskq) == -1) {
+		server_log(srv, "disk pool disabled: %s", strerror(errno));
+		srv->pool = NULL;
+		return;
+	}
+	server_event_set(srv, &srv->disk_ev, srv->diskq.efd,
+	    EV_READ | EV_PERSIST, server_disk, srv);
+	event_add(&srv->disk_ev, NULL);
+}
+
+/* the variant cache and its compression thread, unless the process has them */
+void
+server_zcache(struct server *srv)
+{
+	if (srv->zcache_size == 0 || srv->zcache != NULL)
+		return;
+	if ((srv->zcache = zcache_create(srv->zcache_size)) == NULL ||
+	    (srv->zpool = pool_create(ZCACHE_THREADS)) == NULL) {
+		server_log(srv, "compression cache disabled: %s",
+		    strerror(errno));
+		srv->zcache = NULL;
+	}
+}
+
+/* this worker's empty connection pools, one per upstream group */
+void
+server_proxy(struct server *srv)
+{
+	int i, b;
+
+	srv->proxies = NULL;
+	if (srv->nupstreams == 0)
+		return;
+	if ((srv->proxies = calloc(srv->nupstreams,
+	    sizeof(*srv->proxies))) == NULL) {
+		server_log(srv, "calloc: %s", strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < srv->nupstreams; i++)
+		for (b = 0; b < UPSTREAM_BACKENDS_MAX; b++)
+			SLIST_INIT(&srv->proxies[i].idle[b]);
+}
+
+void
+server_worker(struct server *srv, int i)
+{
+	cpu_set_t set;
+	long ncpu;
+
+	snprintf(srv->name, sizeof(srv->name), "worker(%d)", i);
+	srv->is_master = 0;
+	srv->id = i;
+	log_start(srv->name);
+
+	if ((requests = slab_create(sizeof(struct request))) == NULL) {
+		server_log(srv, "slab_create: %s", strerror(errno));
+		exit(1);
+	}
+	SLIST_INIT(&srv->reqbufs);
+	srv->nreqbufs = 0;
+	srv->in_mem = 0;
+	srv->out_mem = 0;
+	wheel_init(&srv->timers);
+
+	/* a thread per core is always pinned to its core */
+	if ((srv->steer || srv->threaded) &&
+	    (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+		CPU_ZERO(&set);
+		CPU_SET(i % ncpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			server_log(srv, "sched_setaffinity: %s", strerror(errno));
+	}
+
+	if ((srv->base = event_base_new()) == NULL) {
+		server_log(srv, "event_base_new failed");
+		exit(1);
+	}
+	if (srv->engine == ENGINE_URING && server_uring(srv) == -1) {
+		server_log(srv, "io_uring unavailable, using libevent: %s",
+		    strerror(errno));
+		srv->engine = ENGINE_LIBEVENT;
+	}
+	if (srv->engine == ENGINE_LIBEVENT) {
+		if (srv->listen_mode == LISTEN_EXCLUSIVE &&
+		    server_exclusive(srv) == -1) {
+			server_log(srv,
+			    "EPOLLEXCLUSIVE unavailable, sharing accept");
+			srv->listen_mode = LISTEN_SHARED;
+		}
+		if (srv->listen_mode != LISTEN_EXCLUSIVE)
+			server_event_set(srv, &srv->ev, srv->fd,
+			    EV_READ | EV_PERSIST, server_accept, srv);
+		event_add(&srv->ev, 0);
+	}
+	server_fdcache(srv);
+	server_pool(srv);
+	server_zcache(srv);
+	server_proxy(srv);
+	server_stats_start(srv);
+
+	/* worker threads leave signals to the main thread */
+	if (!srv->threaded) {
+		server_event_set(srv, &srv->sigterm, SIGTERM,
+		    EV_SIGNAL | EV_PERSIST, worker_shutdown, srv);
+		signal_add(&srv->sigterm, NULL);
+	}
+}
+
+/* only there to wake an idle loop so deadlines still fire */
+void
+server_tick(int fd, short what, void *arg)
+{
+	struct server *srv = arg;
+
+	(void)fd;
+	(void)what;
+	srv->tick_next = 0;
+}
+
+/*
+ * Wake the loop when the wheel next has work, if it has any: a worker
+ * with nothing due sleeps until something happens.
+ */
+void
+server_tick_arm(struct server *srv)
+{
+	uint64_t next = wheel_next(&srv->timers);
+	unsigned int ms;
+	struct timeval tv;
+
+	if (next == srv->tick_next)
+		return;
+	srv->tick_next = next;
+	if (next == 0) {
+		event_del(&srv->tick_ev);
+		return;
+	}
+	ms = wheel_ms(next);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = ms % 1000 * 1000;
+	event_add(&srv->tick_ev, &tv);
+}
+
+/*
+ * Run a worker's loop one iteration at a time, advancing the timing
+ * wheel after each batch of events and then submitting everything the
+ * iteration queued for io_uring in one system call.
+ */
+void
+server_run(struct server *srv)
+{
+	server_event_set(srv, &srv->tick_ev, -1, 0, server_tick, srv);
+	srv->tick_next = 0;
+	for (;;) {
+		if (srv->engine == ENGINE_URING)
+			uring_submit(&srv->ring);
+		server_tick_arm(srv);
+		if (event_base_loop(srv->base, EVLOOP_ONCE) != 0)
+			break;
+		wheel_advance(&srv->timers);
+	}
+}
+
+void *
+server_thread(void *arg)
+{
+	struct server *srv = arg;
+
+	server_worker(srv, srv->id);
+	server_log(srv, "dispatching");
+	server_run(srv);
+	return NULL;
+}
+
+/*
+ * Run the workers as threads of this process, each with its own copy
+ * of the configuration and its own loop, connections, timers and file
+ * cache; only the hot-file cache and the log flusher are shared. The
+ * configuration never changes once workers run, so the copies need no
+ * synchronization. Signals stay blocked in the workers.
+ */
+int
+server_threads(struct server *srv, int *fds)
+{
+	struct server *srvs;
+	sigset_t all, old;
+	pthread_t tid;
+	int i, error = 0;
+
+	if ((srvs = calloc(srv->nworkers, sizeof(*srvs))) == NULL)
+		return -1;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < srv->nworkers && error == 0; i++) {
+		srvs[i] = *srv;
+		srvs[i].fd = fds[i];
+		srvs[i].id = i;
+		if ((error = pthread_create(&tid, NULL, server_thread,
+		    &srvs[i])) == 0)
+			pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void
+signal_handler(int sig, short event, void *arg)
+{
+	int i;
+	pid_t pid;
+	struct server *srv = arg;
+
+	(void)sig;
+	(void)event;
+	server_log(srv, "shutting down");
+
+	for (i = 0; workers != NULL && i < srv->nworkers; i++) {
+		pid = workers[i];
+		server_log(srv, "stopping %d", (int)pid);
+		if (pid != -1)
+			kill(pid, SIGTERM);
+	}
+	log_close();
+	printf("goodbye\n");
+	exit(0);
+}
+
+
+void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-Stv] [-B max-body-bytes] [-b backlog] "
+	    "[-c cache-bytes] [-d disk-threads]\n"
+	    "\t[-e libevent|io_uring] [-H max-header-bytes]\n"
+	    "\t[-l shared|reuseport|exclusive] [-m mime-types-file] "
+	    "[-n workers]\n"
+	    "\t[-u /prefix=addr:port[,addr:port...]] "
+	    "[-W output-high-water-bytes]\n"
+	    "\t[-z compression-cache-bytes]\n",
+	    progname);
+	exit(1);
+}
+
+size_t
+parse_size(const char *progname, const char *arg)
+{
+	char *end;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || n == 0)
+		usage(progname);
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct event sigint, sigterm, sighup;
+	struct server srv;
+	size_t size;
+	long ncpu;
+	int *fds;
+	int i, ch;
+	pid_t pid;
+
+	// set server root and log_path
+	snprintf(srv.root, sizeof(srv.root), "%s", SRV_ROOT);
+	snprintf(srv.log_path, PATH_MAX, "%s", LOG_PATH);
+	srv.root_fd = -1;
+	snprintf(srv.name, sizeof(srv.name), "master");
+	srv.max_header_size = MAX_HEADER_SIZE;
+	srv.max_body_size = MAX_BODY_SIZE;
+	srv.out_highwat = OUT_HIGHWAT;
+	srv.listen_mode = LISTEN_SHARED;
+	srv.steer = 0;
+	srv.efd = -1;
+	srv.backlog = default_backlog();
+	srv.is_master = 1;
+	srv.log_level = LVL_INFO;
+	srv.cache = NULL;
+	srv.cache_size = CACHE_SIZE;
+	srv.fdcache = NULL;
+	srv.pool = NULL;
+	srv.disk_threads = DISK_THREADS;
+	srv.zcache = NULL;
+	srv.zcache_size = ZCACHE_SIZE;
+	srv.zpool = NULL;
+	srv.engine = ENGINE_LIBEVENT;
+	srv.id = -1;
+	srv.nworkers = 0;
+	srv.threaded = 0;
+	srv.upstreams = NULL;
+	srv.nupstreams = 0;
+	srv.proxies = NULL;
+
+	while ((ch = getopt(argc, argv, "B:b:c:d:e:H:l:m:n:Stu:vW:z:")) != -1) {
+		switch (ch) {
+		case 'B':
+			srv.max_body_size = parse_size(argv[0], optarg);
+			break;
+		case 'b':
+			size = parse_size(argv[0], optarg);
+			srv.backlog = MINIMUM(size, INT_MAX);
+			break;
+		case 'c':
+			if (strcmp(optarg, "0") == 0)
+				srv.cache_size = 0;
+			else
+				srv.cache_size = parse_size(argv[0], optarg);
+			break;
+		case 'd':
+			if (strcmp(optarg, "0") == 0)
+				srv.disk_threads = 0;
+			else {
+				size = parse_size(argv[0], optarg);
+				srv.disk_threads = MINIMUM(size, 256);
+			}
+			break;
+		case 'e':
+			if (strcmp(optarg, "libevent") == 0)
+				srv.engine = ENGINE_LIBEVENT;
+			else if (strcmp(optarg, "io_uring") == 0)
+				srv.engine = ENGINE_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 'H':
+			srv.max_header_size = parse_size(argv[0], optarg);
+			break;
+		case 'l':
+			if (strcmp(optarg, "shared") == 0)
+				srv.listen_mode = LISTEN_SHARED;
+			else if (strcmp(optarg, "reuseport") == 0)
+				srv.listen_mode = LISTEN_REUSEPORT;
+			else if (strcmp(optarg, "exclusive") == 0)
+				srv.listen_mode = LISTEN_EXCLUSIVE;
+			else
+				usage(argv[0]);
+			break;
+		case 'm':
+			/* before any worker looks a type up */
+			if (mime_load(optarg) == -1) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			size = parse_size(argv[0], optarg);
+			srv.nworkers = MINIMUM(size, 1024);
+			break;
+		case 'S':
+			srv.steer = 1;
+			break;
+		case 't':
+			srv.threaded = 1;
+			break;
+		case 'u':
+			if (srv.upstreams == NULL &&
+			    (srv.upstreams = calloc(UPSTREAMS_MAX,
+			    sizeof(*srv.upstreams))) == NULL) {
+				perror("calloc");
+				return 1;
+			}
+			if (srv.nupstreams == UPSTREAMS_MAX ||
+			    upstream_parse(&srv.upstreams[srv.nupstreams],
+			    optarg) == -1)
+				usage(argv[0]);
+			srv.upstreams[srv.nupstreams].id = srv.nupstreams;
+			srv.nupstreams++;
+			break;
+		case 'v':
+			srv.log_level++;
+			break;
+		case 'W':
+			srv.out_highwat = parse_size(argv[0], optarg);
+			break;
+		case 'z':
+			if (strcmp(optarg, "0") == 0)
+				srv.zcache_size = 0;
+			else
+				srv.zcache_size = parse_size(argv[0], optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if ((srv.log_fd = open(srv.log_path,
+	    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		perror("open logfile");
+		return 1;
+	}
+	log_init(srv.log_fd, srv.log_level, srv.name);
+	response_init();
+
+	if ((srv.root_fd = root_init(srv.root)) == -1) {
+		perror(srv.root);
+		return 1;
+	}
+	if ((srv.router = server_routes(&srv)) == NULL) {
+		perror("server_routes");
+		return 1;
+	}
+
+	if (srv.nworkers == 0) {
+		srv.nworkers = NWORKERS;
+		if (srv.threaded && (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+			srv.nworkers = MINIMUM(ncpu, 1024);
+	}
+	if ((fds = calloc(srv.nworkers, sizeof(*fds))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	/* mapped before the workers start so they all share it */
+	if (srv.cache_size > 0 &&
+	    (srv.cache = cache_create(srv.cache_size)) == NULL)
+		server_log(&srv, "cache disabled: %s", strerror(errno));
+
+	/*
+	 * Bind every reuseport socket up front, in worker order, so a
+	 * failure shows before forking and the group order matches the
+	 * worker index the steering program returns.
+	 */
+	if (srv.listen_mode == LISTEN_REUSEPORT) {
+		for (i = 0; i < srv.nworkers; i++) {
+			if ((fds[i] = server_listen(1, srv.backlog)) == -2) {
+				server_log(&srv, "SO_REUSEPORT unavailable, "
+				    "using EPOLLEXCLUSIVE");
+				srv.listen_mode = LISTEN_EXCLUSIVE;
+				while (i-- > 0)
+					close(fds[i]);
+				break;
+			}
+			if (fds[i] == -1)
+				return 1;
+		}
+		if (srv.listen_mode == LISTEN_REUSEPORT && srv.steer &&
+		    server_steer(fds[0], srv.nworkers) == -1)
+			server_log(&srv, "SO_ATTACH_REUSEPORT_CBPF: %s",
+			    strerror(errno));
+	}
+	if (srv.listen_mode != LISTEN_REUSEPORT) {
+		if ((srv.fd = server_listen(0, srv.backlog)) < 0)
+			return 1;
+		for (i = 0; i < srv.nworkers; i++)
+			fds[i] = srv.fd;
+	}
+
+	if (srv.threaded) {
+		srv.base = event_init();
+		/* one disk pool for all the worker threads */
+		if (srv.disk_threads > 0 &&
+		    (srv.pool = pool_create(srv.disk_threads)) == NULL) {
+			server_log(&srv, "disk pool disabled: %s",
+			    strerror(errno));
+			srv.disk_threads = 0;
+		}
+		/* and one cache of compressed variants */
+		server_zcache(&srv);
+		if (server_threads(&srv, fds) == -1) {
+			server_log(&srv, "pthread_create: %s", strerror(errno));
+			return 1;
+		}
+	} else {
+		if ((workers = calloc(srv.nworkers, sizeof(*workers))) == NULL) {
+			perror("calloc");
+			return 1;
+		}
+		for (i = 0; i < srv.nworkers; i++) {
+			pid = fork();
+			if (pid == 0) {
+				srv.fd = fds[i];
+				if (srv.listen_mode == LISTEN_REUSEPORT) {
+					for (ch = 0; ch < srv.nworkers; ch++)
+						if (ch != i)
+							close(fds[ch]);
+				}
+				server_worker(&srv, i);
+				server_log(&srv, "dispatching");
+				server_run(&srv);
+				return 1;
+			}
+			server_log(&srv, "adding %d", pid);
+			workers[i] = pid;
+		}
+
+		/* the workers own the listening sockets now */
+		if (srv.listen_mode == LISTEN_REUSEPORT)
+			for (i = 0; i < srv.nworkers; i++)
+				close(fds[i]);
+		srv.base = event_init();
+	}
+
+	signal_set(&sigint, SIGINT, signal_handler, &srv);
+	signal_set(&sigterm, SIGTERM, signal_handler, &srv);
+	signal_set(&sighup, SIGHUP, signal_handler, &srv);
+
+	signal_add(&sigint, NULL);
+	signal_add(&sigterm, NULL);
+	signal_add(&sighup, NULL);
+
+	server_stats_start(&srv);
+	log_start(srv.name);
 
 	server_log(&srv, "dispatching", srv.name);
 	event_dispatch();
@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+/* a handle is the slot index in the low half, its generation in the high */
+#define HANDLE_BITS (sizeof(uintptr_t) * 4)
+#define HANDLE_MASK (((uintptr_t)1 << HANDLE_BITS) - 1)
+
+/* follows every object, in the padding up to the next cache line */
+struct slab_slot {
+	uint32_t index;
+	uint32_t gen;		/* odd while allocated */
+	uint32_t next;		/* freelist link, index + 1 or 0 */
+};
+
+struct slab {
+	size_t stride;		/* object plus slot, a multiple of SLAB_ALIGN */
+	size_t slotoff;		/* where the slot is within the stride */
+	char **chunks;
+	size_t nchunks;
+	uint32_t free;		/* freelist head, index + 1 or 0 */
+	size_t inuse;
+};
+
+static char *
+slab_obj(struct slab *s, uint32_t index)
+{
+	return s->chunks[index / SLAB_CHUNK] + (index % SLAB_CHUNK) * s->stride;
+}
+
+static struct slab_slot *
+slab_slot(struct slab *s, void *obj)
+{
+	return (struct slab_slot *)((char *)obj + s->slotoff);
+}
+
+struct slab *
+slab_create(size_t size)
+{
+	struct slab *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+	s->slotoff = (size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+	s->stride = (s->slotoff + sizeof(struct slab_slot) + SLAB_ALIGN - 1) &
+	    ~(size_t)(SLAB_ALIGN - 1);
+	return s;
+}
+
+static int
+slab_grow(struct slab *s)
+{
+	struct slab_slot *slot;
+	char **chunks, *chunk;
+	uint32_t i, base;
+
+	if ((s->nchunks + 1) * SLAB_CHUNK > HANDLE_MASK)
+		return -1;
+	chunks = realloc(s->chunks, (s->nchunks + 1) * sizeof(*chunks));
+	if (chunks == NULL)
+		return -1;
+	s->chunks = chunks;
+	if (posix_memalign((void **)&chunk, SLAB_ALIGN,
+	    SLAB_CHUNK * s->stride) != 0)
+		return -1;
+	s->chunks[s->nchunks] = chunk;
+	base = s->nchunks * SLAB_CHUNK;
+	s->nchunks++;
+	/* thread the new slots onto the freelist, lowest first */
+	for (i = SLAB_CHUNK; i-- > 0; ) {
+		slot = slab_slot(s, slab_obj(s, base + i));
+		slot->index = base + i;
+		slot->gen = 0;
+		slot->next = s->free;
+		s->free = base + i + 1;
+	}
+	return 0;
+}
+
+void *
+slab_alloc(struct slab *s)
+{
+	struct slab_slot *slot;
+	char *obj;
+
+	if (s->free == 0 && slab_grow(s) == -1)
+		return NULL;
+	obj = slab_obj(s, s->free - 1);
+	slot = slab_slot(s, obj);
+	s->free = slot->next;
+	slot->gen++;
+	s->inuse++;
+	return obj;
+}
+
+void
+slab_free(struct slab *s, void *obj)
+{
+	struct slab_slot *slot = slab_slot(s, obj);
+
+	slot->gen++;
+	slot->next = s->free;
+	s->free = slot->index + 1;
+	s->inuse--;
+}
+
+uintptr_t
+slab_handle(struct slab *s, void *obj)
+{
+	struct slab_slot *slot = slab_slot(s, obj);
+
+	return ((uintptr_t)slot->gen << HANDLE_BITS) | slot->index;
+}
+
+/* the object behind a handle, or NULL if it was freed since */
+void *
+slab_lookup(struct slab *s, uintptr_t handle)
+{
+	struct slab_slot *slot;
+	uintptr_t index = handle & HANDLE_MASK;
+	char *obj;
+
+	if (index >= s->nchunks * SLAB_CHUNK)
+		return NULL;
+	obj = slab_obj(s, index);
+	slot = slab_slot(s, obj);
+	if (((uintptr_t)slot->gen & HANDLE_MASK) != handle >> HANDLE_BITS ||
+	    (slot->gen & 1) == 0)
+		return NULL;
+	return obj;
+}
+
+void
+slab_stats(struct slab *s, struct slab_stats *st)
+{
+	st->inuse = s->inuse;
+	st->capacity = s->nchunks * SLAB_CHUNK;
+	st->bytes = st->capacity * s->stride;
+}
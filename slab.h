@@ -0,0 +1,32 @@
+#ifndef slab_h
+#define slab_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_ALIGN (64)		/* objects start on a cache line */
+#define SLAB_CHUNK (64)		/* objects allocated at a time */
+
+/*
+ * Fixed-size object pool for one process. Freed objects go on a LIFO
+ * freelist and are reused while still warm; memory is never returned.
+ * Each slot has a generation that changes on every alloc and free, so a
+ * handle taken while an object was live stops resolving once it is
+ * freed, even if the slot has been reused since.
+ */
+struct slab;
+
+struct slab_stats {
+	size_t inuse;
+	size_t capacity;
+	size_t bytes;		/* chunk memory, in use or not */
+};
+
+struct slab	*slab_create(size_t size);
+void		*slab_alloc(struct slab *);
+void		 slab_free(struct slab *, void *);
+uintptr_t	 slab_handle(struct slab *, void *);
+void		*slab_lookup(struct slab *, uintptr_t handle);
+void		 slab_stats(struct slab *, struct slab_stats *);
+
+#endif
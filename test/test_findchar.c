@@ -0,0 +1,352 @@
+/*
+ * Runs every findchar_fast() kernel this CPU supports against the
+ * byte-at-a-time path on inputs picked to hit their edges: tails shorter
+ * than a vector, bytes with the high bit set, and control characters in
+ * every lane. Then parses requests with each kernel in turn, whole and
+ * split across two reads at every offset, and expects the answers of the
+ * scalar parser. The parser is included rather than linked so the static
+ * kernels can be reached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../picohttpparser.c"
+
+#define LEN_MAX (200)		/* past two AVX-512 vectors and a tail */
+#define HEADERS_MAX (16)
+
+typedef const char *(*kernel_fn)(const char *, const char *,
+    const struct findchar_set *, int *);
+
+struct kernel {
+	const char *name;
+	kernel_fn fn;
+	int (*supported)(void);	/* NULL if any CPU runs it */
+	int nibbles;		/* needs the nibble tables */
+};
+
+struct parse {
+	int ret;
+	const char *method;
+	size_t method_len;
+	const char *path;
+	size_t path_len;
+	int minor_version;
+	struct phr_header headers[HEADERS_MAX];
+	size_t num_headers;
+};
+
+#if FINDCHAR_DISPATCH
+static int
+cpu_sse42(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static int
+cpu_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int
+cpu_avx512(void)
+{
+	return __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+static int failures;
+static int checks;
+
+static void
+check(const char *kernel, const char *name, int cond)
+{
+	checks++;
+	if (!cond) {
+		failures++;
+		printf("FAIL %s: %s\n", kernel, name);
+	}
+}
+
+static int
+in_set(const struct findchar_set *set, unsigned char c)
+{
+	int i;
+
+	for (i = 0; i < set->ranges_size; i += 2)
+		if (c >= (unsigned char)set->ranges[i] &&
+		    c <= (unsigned char)set->ranges[i + 1])
+			return 1;
+	return 0;
+}
+
+/*
+ * Where the kernel and then the scalar loop of its callers stop, which
+ * must be the first byte in the set, or the end. The kernel must not
+ * skip a byte of the set nor claim one that is not.
+ */
+static int
+run(const struct kernel *k, const struct findchar_set *set,
+    const char *map, const unsigned char *in, size_t len)
+{
+	const char *buf, *end, *p;
+	char *copy;
+	size_t first;
+	int found, ok;
+
+	for (first = 0; first < len && !map[in[first]]; first++)
+		;
+	/* exactly sized, so a read past the end shows up under ASan */
+	if ((copy = malloc(len == 0 ? 1 : len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(copy, in, len);
+	buf = copy;
+	end = copy + len;
+	p = k->fn(buf, end, set, &found);
+	ok = p >= buf && p <= end && (size_t)(p - buf) <= first;
+	if (ok && found)
+		ok = (size_t)(p - buf) == first;
+	if (ok && !found) {
+		while (p != end && !map[(unsigned char)*p])
+			p++;
+		ok = (size_t)(p - buf) == first;
+	}
+	free(copy);
+	return ok;
+}
+
+static void
+test_set(const struct kernel *k, const char *name,
+    const struct findchar_set *set)
+{
+	unsigned char in[LEN_MAX], filler[256];
+	char map[256];
+	static const unsigned char probes[] = {
+		0x00, 0x01, 0x08, 0x09, 0x0a, 0x0d, 0x1f, ' ', '"', ':',
+		'@', '{', 0x7f, 0x80, 0xc3, 0xfe, 0xff
+	};
+	size_t len, pos, i, nfiller = 0;
+	unsigned int seed = 1;
+	int c, ok;
+
+	/* bytes the kernel has to walk past, high ones included */
+	for (c = 0; c < 256; c++)
+		if (!(map[c] = in_set(set, c)))
+			filler[nfiller++] = c;
+
+	/* every byte value in every lane, behind nothing else */
+	ok = 1;
+	for (c = 0; c < 256; c++)
+		for (pos = 0; pos < LEN_MAX; pos++) {
+			memset(in, 'a', sizeof(in));
+			in[pos] = c;
+			ok &= run(k, set, map, in, sizeof(in));
+		}
+	check(k->name, name, ok);
+
+	/* every length, so every tail, with a probe at every position */
+	ok = 1;
+	for (len = 0; len <= LEN_MAX; len++) {
+		for (i = 0; i < len; i++)
+			in[i] = filler[(len + i) % nfiller];
+		ok &= run(k, set, map, in, len);
+		for (pos = 0; pos < len; pos++) {
+			for (i = 0; i < sizeof(probes); i++) {
+				in[pos] = probes[i];
+				ok &= run(k, set, map, in, len);
+			}
+			in[pos] = filler[(len + pos) % nfiller];
+		}
+	}
+	check(k->name, name, ok);
+
+	/* mostly allowed bytes, now and then one of the set */
+	ok = 1;
+	for (i = 0; i < 20000; i++) {
+		len = rand_r(&seed) % (LEN_MAX + 1);
+		for (pos = 0; pos < len; pos++)
+			in[pos] = rand_r(&seed) % 64 == 0 ? rand_r(&seed) & 0xff :
+			    filler[rand_r(&seed) % nfiller];
+		ok &= run(k, set, map, in, len);
+	}
+	check(k->name, name, ok);
+}
+
+static void
+parse(const char *buf, size_t len, size_t last_len, struct parse *p)
+{
+	p->num_headers = HEADERS_MAX;
+	p->ret = phr_parse_request(buf, len, &p->method, &p->method_len,
+	    &p->path, &p->path_len, &p->minor_version, p->headers,
+	    &p->num_headers, last_len);
+}
+
+/* the same answer, relative to each buffer */
+static int
+parse_equal(const struct parse *a, const char *abuf, const struct parse *b,
+    const char *bbuf)
+{
+	size_t i;
+
+	if (a->ret != b->ret)
+		return 0;
+	if (a->ret < 0)
+		return 1;
+	if (a->method - abuf != b->method - bbuf ||
+	    a->method_len != b->method_len ||
+	    a->path - abuf != b->path - bbuf || a->path_len != b->path_len ||
+	    a->minor_version != b->minor_version ||
+	    a->num_headers != b->num_headers)
+		return 0;
+	for (i = 0; i < a->num_headers; i++)
+		if ((a->headers[i].name == NULL) != (b->headers[i].name == NULL) ||
+		    (a->headers[i].name != NULL &&
+		    a->headers[i].name - abuf != b->headers[i].name - bbuf) ||
+		    a->headers[i].name_len != b->headers[i].name_len ||
+		    a->headers[i].value - abuf != b->headers[i].value - bbuf ||
+		    a->headers[i].value_len != b->headers[i].value_len)
+			return 0;
+	return 1;
+}
+
+/*
+ * Parse req with the kernel whole and split into two reads at every
+ * offset, and compare with the scalar parse.
+ */
+static int
+test_request(const struct kernel *k, const char *req, size_t len)
+{
+	struct parse want, got;
+	char *buf;
+	size_t split;
+	int ok;
+
+	if ((buf = malloc(len)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(buf, req, len);
+	findchar_fast = findchar_none;
+	findchar_vector = 0;
+	parse(buf, len, 0, &want);
+	findchar_fast = k->fn;
+	findchar_vector = k->fn != findchar_none;
+	parse(buf, len, 0, &got);
+	ok = parse_equal(&want, buf, &got, buf);
+	for (split = 0; ok && split < len; split++) {
+		parse(buf, split, 0, &got);
+		/* a prefix is short, or already wrong */
+		ok = got.ret == -2 || (got.ret == -1 && want.ret == -1);
+		if (ok && got.ret == -2) {
+			parse(buf, len, split, &got);
+			ok = parse_equal(&want, buf, &got, buf);
+		}
+	}
+	free(buf);
+	return ok;
+}
+
+static void
+test_parser(const struct kernel *k)
+{
+	static const unsigned char ctls[] = {
+		0x00, 0x01, 0x08, 0x0b, 0x0d, 0x1f, 0x7f
+	};
+	char req[1024], name[80], value[LEN_MAX + 1];
+	size_t pos, i;
+	int n, ok;
+
+	/* a header name longer than any vector */
+	memset(name, 'x', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	memcpy(name, "X-Long-", 7);
+	/* and a value with every high byte in it */
+	for (pos = 0; pos < LEN_MAX; pos++)
+		value[pos] = 0x80 + pos % 0x80;
+	value[LEN_MAX] = '\0';
+
+	n = snprintf(req, sizeof(req), "GET /%s HTTP/1.1\r\n"
+	    "Host: example.com\r\n%s: %s\r\nAccept: */*\r\n\r\n",
+	    value, name, value);
+	check(k->name, "valid request", test_request(k, req, n));
+
+	/* a control character in every lane of the path and the value */
+	ok = 1;
+	for (pos = 0; pos < LEN_MAX; pos++)
+		for (i = 0; i < sizeof(ctls); i++) {
+			memset(value, 'v', LEN_MAX);
+			value[pos] = ctls[i];
+			n = snprintf(req, sizeof(req), "GET /x HTTP/1.1\r\n"
+			    "Host: example.com\r\nX-Value: ");
+			memcpy(req + n, value, LEN_MAX);
+			n += LEN_MAX;
+			n += snprintf(req + n, sizeof(req) - n, "\r\n\r\n");
+			ok &= test_request(k, req, n);
+			n = snprintf(req, sizeof(req), "GET /");
+			memcpy(req + n, value, LEN_MAX);
+			n += LEN_MAX;
+			n += snprintf(req + n, sizeof(req) - n,
+			    " HTTP/1.1\r\nHost: example.com\r\n\r\n");
+			ok &= test_request(k, req, n);
+		}
+	check(k->name, "control characters", ok);
+
+	/* bytes a header name may not have, in every lane of a long one */
+	ok = 1;
+	for (pos = 0; pos < sizeof(name) - 1; pos++)
+		for (i = 0; i < 4; i++) {
+			memset(name, 'n', sizeof(name) - 1);
+			name[pos] = "\x80\xff\"@"[i];
+			n = snprintf(req, sizeof(req), "GET /x HTTP/1.1\r\n"
+			    "%s: v\r\n\r\n", name);
+			ok &= test_request(k, req, n);
+		}
+	check(k->name, "header names", ok);
+}
+
+int
+main(void)
+{
+#if FINDCHAR_DISPATCH
+	static const struct kernel kernels[] = {
+		{ "none", findchar_none, NULL, 0 },
+		{ "sse4.2", findchar_sse42, cpu_sse42, 0 },
+		{ "avx2", findchar_avx2, cpu_avx2, 1 },
+		{ "avx512", findchar_avx512, cpu_avx512, 1 },
+	};
+	const struct kernel *k;
+	int c, nibbles;
+
+	nibbles = findchar_nibbles(&token_set) == 0 &&
+	    findchar_nibbles(&eol_set) == 0 &&
+	    findchar_nibbles(&header_name_set) == 0;
+	check("tables", "nibbles", nibbles);
+	/* the set may stop early, the scalar loop takes over, never late */
+	for (c = 0; c < 256; c++)
+		if (!token_char_map[c] && !in_set(&header_name_set, c))
+			break;
+	check("tables", "header names", c == 256);
+
+	__builtin_cpu_init();
+	for (k = kernels; k < kernels + sizeof(kernels) / sizeof(*kernels);
+	    k++) {
+		if ((k->supported != NULL && !k->supported()) ||
+		    (k->nibbles && !nibbles)) {
+			printf("skipping %s\n", k->name);
+			continue;
+		}
+		test_set(k, "token", &token_set);
+		test_set(k, "end of line", &eol_set);
+		test_set(k, "header name", &header_name_set);
+		test_parser(k);
+	}
+#else
+	printf("no kernels to compare\n");
+#endif
+	printf("%d of %d checks passed\n", checks - failures, checks);
+	return failures != 0;
+}
@@ -0,0 +1,459 @@
+#!/usr/bin/env python3
+#
+# Runs ./server and checks what it answers over real connections. The
+# files it serves go in a scratch directory under the server's root,
+# which is removed again afterwards; what it proxies goes to a stub
+# backend the test runs itself. Run from anywhere; `make test'
+# builds the server first. Extra arguments are passed to the server,
+# e.g. -e io_uring.
+
+import os
+import shutil
+import signal
+import socket
+import socketserver
+import subprocess
+import sys
+import threading
+import time
+
+HOST = '127.0.0.1'
+PORT = 8080		# PORT_NO in server.c
+ROOT = '/var/www/html'	# SRV_ROOT in server.c
+DIR = 'server-test'	# under ROOT
+
+failures = 0
+checks = 0
+
+
+def check(name, cond):
+	global failures, checks
+	checks += 1
+	if not cond:
+		failures += 1
+		print('FAIL', name)
+
+
+class Response:
+	def __init__(self, status, headers, body):
+		self.status = status
+		self.headers = headers	# lower-cased names
+		self.body = body
+
+	def header(self, name):
+		return self.headers.get(name.lower())
+
+
+class Conn:
+	"""One client connection, reading responses off it one at a time."""
+
+	def __init__(self, timeout=5):
+		self.sock = socket.create_connection((HOST, PORT))
+		self.sock.settimeout(timeout)
+		self.buf = b''
+
+	def send(self, data):
+		self.sock.sendall(data)
+
+	def fill(self):
+		data = self.sock.recv(65536)
+		if not data:
+			raise EOFError
+		self.buf += data
+
+	def take(self, n):
+		while len(self.buf) < n:
+			self.fill()
+		data, self.buf = self.buf[:n], self.buf[n:]
+		return data
+
+	def line(self):
+		while b'\r\n' not in self.buf:
+			self.fill()
+		data, self.buf = self.buf.split(b'\r\n', 1)
+		return data
+
+	def response(self, head=False):
+		"""The next response; one to HEAD has no body whatever it says."""
+		status = int(self.line().split()[1])
+		headers = {}
+		while True:
+			line = self.line()
+			if not line:
+				break
+			name, value = line.split(b':', 1)
+			headers[name.decode().lower()] = value.strip().decode()
+		res = Response(status, headers, b'')
+		if head or status in (204, 304) or 100 <= status < 200:
+			return res
+		if headers.get('transfer-encoding', '').endswith('chunked'):
+			while True:
+				n = int(self.line().split(b';')[0], 16)
+				if n == 0:
+					while self.line():
+						pass
+					break
+				res.body += self.take(n)
+				self.take(2)
+		elif 'content-length' in headers:
+			res.body = self.take(int(headers['content-length']))
+		else:
+			try:
+				while True:
+					self.fill()
+			except EOFError:
+				pass
+			res.body, self.buf = self.buf, b''
+		return res
+
+	def close(self):
+		self.sock.close()
+
+
+def request(method, path, headers='', body=b'', version='1.1'):
+	return ('%s %s HTTP/%s\r\nHost: test\r\n%s' % (method, path, version,
+	    headers)).encode() + (b'Content-Length: %d\r\n' % len(body) if body
+	    else b'') + b'\r\n' + body
+
+
+def fetch(method, path, headers=''):
+	c = Conn()
+	c.send(request(method, path, headers + 'Connection: close\r\n'))
+	res = c.response(head=method == 'HEAD')
+	c.close()
+	return res
+
+
+def test_parser(files):
+	# the head a byte at a time
+	c = Conn()
+	for b in request('GET', '/%s/a.txt' % DIR):
+		c.send(bytes([b]))
+		time.sleep(0.002)
+	res = c.response()
+	check('head by bytes', res.status == 200 and res.body == files['a.txt'])
+	# a body that comes well after its head, then a pipelined request
+	c.send(b'POST /%s/a.txt HTTP/1.1\r\nHost: test\r\n'
+	    b'Content-Length: 10\r\n\r\n01234' % DIR.encode())
+	time.sleep(0.2)
+	c.send(b'56789' + request('GET', '/%s/b.txt' % DIR))
+	res = c.response()
+	check('late body', res.status == 405)
+	res = c.response()
+	check('after late body', res.status == 200 and
+	    res.body == files['b.txt'])
+	# several requests in one packet, answered in order
+	c.send(b''.join(request('GET', '/%s/%s' % (DIR, f))
+	    for f in ('a.txt', 'b.txt', 'a.txt')))
+	bodies = [c.response().body for i in range(3)]
+	check('pipelined', bodies == [files['a.txt'], files['b.txt'],
+	    files['a.txt']])
+	c.close()
+	# a malformed request line
+	c = Conn()
+	c.send(b'GET\r\n\r\n')
+	check('malformed', c.response().status == 400)
+	c.close()
+	# Connection is a list of options
+	c = Conn()
+	c.send(request('GET', '/%s/b.txt' % DIR, 'Connection: close, TE\r\n'))
+	c.response()
+	try:
+		c.fill()
+		check('close listed', False)
+	except EOFError:
+		check('close listed', c.buf == b'')
+	c.close()
+	c = Conn()
+	c.send(request('GET', '/%s/b.txt' % DIR,
+	    'Connection: keep-alive, Upgrade\r\n', version='1.0') +
+	    request('GET', '/%s/a.txt' % DIR, version='1.0'))
+	c.response()
+	check('keep-alive listed', c.response().body == files['a.txt'])
+	c.close()
+	# lengths that disagree frame the body no one way
+	c = Conn()
+	c.send(b'POST /%s/a.txt HTTP/1.1\r\nHost: test\r\nContent-Length: 1\r\n'
+	    b'Content-Length: 2\r\n\r\nxx' % DIR.encode())
+	check('conflicting lengths', c.response().status == 400)
+	c.close()
+
+
+def test_head(files):
+	data = files['a.txt']
+	c = Conn()
+	c.send(request('HEAD', '/%s/a.txt' % DIR) +
+	    request('GET', '/%s/b.txt' % DIR))
+	res = c.response(head=True)
+	check('HEAD length', res.status == 200 and
+	    res.header('Content-Length') == str(len(data)))
+	# no body went out, or it would be read as the next response
+	res = c.response()
+	check('HEAD framing', res.status == 200 and res.body == files['b.txt'])
+	c.send(request('HEAD', '/%s/a.txt' % DIR, 'Range: bytes=0-3\r\n') +
+	    request('HEAD', '/%s/missing' % DIR) +
+	    request('GET', '/%s/b.txt' % DIR))
+	# Range is only defined for GET
+	res = c.response(head=True)
+	check('HEAD range', res.status == 200 and
+	    res.header('Content-Length') == str(len(data)))
+	check('HEAD 404', c.response(head=True).status == 404)
+	check('HEAD then GET', c.response().body == files['b.txt'])
+	c.close()
+
+
+def test_ranges(files):
+	data = files['big.bin']
+	path = '/%s/big.bin' % DIR
+	res = fetch('GET', path)
+	check('full', res.status == 200 and res.body == data and
+	    res.header('Accept-Ranges') == 'bytes')
+	res = fetch('GET', path, 'Range: bytes=10-19\r\n')
+	check('range', res.status == 206 and res.body == data[10:20] and
+	    res.header('Content-Range') == 'bytes 10-19/%d' % len(data))
+	res = fetch('GET', path, 'Range: bytes=-5\r\n')
+	check('suffix', res.status == 206 and res.body == data[-5:])
+	res = fetch('GET', path, 'Range: bytes=%d-\r\n' % (len(data) - 3))
+	check('open', res.status == 206 and res.body == data[-3:])
+	res = fetch('GET', path, 'Range: bytes=%d-\r\n' % len(data))
+	check('unsatisfiable', res.status == 416 and
+	    res.header('Content-Range') == 'bytes */%d' % len(data))
+	res = fetch('GET', path, 'Range: bytes=0-1,100-101\r\n')
+	check('multipart', res.status == 206 and res.header('Content-Type')
+	    .startswith('multipart/byteranges') and data[0:2] in res.body and
+	    data[100:102] in res.body)
+	res = fetch('GET', path, 'Range: bytes=5-2\r\n')
+	check('invalid range', res.status == 200 and res.body == data)
+
+
+def test_conditional(files):
+	path = '/%s/a.txt' % DIR
+	res = fetch('GET', path)
+	etag, modified = res.header('ETag'), res.header('Last-Modified')
+	check('validators', etag is not None and modified is not None)
+	res = fetch('GET', path, 'If-None-Match: %s\r\n' % etag)
+	check('If-None-Match', res.status == 304 and res.body == b'' and
+	    res.header('ETag') == etag)
+	res = fetch('GET', path, 'If-None-Match: "other"\r\n')
+	check('If-None-Match other', res.status == 200)
+	res = fetch('GET', path, 'If-Modified-Since: %s\r\n' % modified)
+	check('If-Modified-Since', res.status == 304)
+	res = fetch('GET', path, 'If-Modified-Since: %s\r\n' %
+	    'Thu, 01 Jan 1970 00:00:00 GMT')
+	check('modified since', res.status == 200)
+	res = fetch('GET', '/%s/big.bin' % DIR,
+	    'Range: bytes=0-3\r\nIf-Range: "other"\r\n')
+	check('If-Range', res.status == 200 and
+	    res.body == files['big.bin'])
+	res = fetch('HEAD', path, 'If-None-Match: %s\r\n' % etag)
+	check('HEAD 304', res.status == 304)
+
+
+def test_cache(files):
+	# what the shared cache holds follows the file
+	path = os.path.join(ROOT, DIR, 'c.txt')
+	for body in (b'first\n', b'second version\n', b'third version\n'):
+		with open(path, 'wb') as f:
+			f.write(body)
+		time.sleep(1.1)	# CACHE_REVALIDATE
+		# on new connections, so they go to every worker
+		bodies = [fetch('GET', '/%s/c.txt' % DIR).body for i in range(16)]
+		check('cached %r' % body, bodies == [body] * 16)
+
+
+def test_router(files):
+	res = fetch('GET', '/%s/missing' % DIR)
+	check('404', res.status == 404)
+	res = fetch('POST', '/%s/a.txt' % DIR)
+	check('405', res.status == 405 and res.header('Allow') == 'GET, HEAD')
+	res = fetch('DELETE', '/server-status')
+	check('405 status', res.status == 405)
+	res = fetch('GET', '/server-status')
+	check('status', res.status == 200 and b'worker' in res.body)
+	# a path is routed by what it means, not how it is spelt
+	res = fetch('GET', '/%73erver-status')
+	check('escaped', res.status == 200 and b'worker' in res.body)
+	res = fetch('GET', '//%s/./x/../a.txt' % DIR)
+	check('dot segments', res.status == 200 and
+	    res.body == files['a.txt'])
+	res = fetch('GET', '/%s/%%2e%%2e/%%2e%%2e/etc/passwd' % DIR)
+	check('above root', res.status == 400)
+	res = fetch('GET', '/%zz')
+	check('bad escape', res.status == 400)
+	# an escaped "/" is part of a segment to the router, so no file has it
+	res = fetch('GET', '/%s/x%%2F..%%2Fa.txt' % DIR)
+	check('escaped slash', res.status == 400)
+
+
+class Backend(socketserver.StreamRequestHandler):
+	"""
+	A stub upstream. /echo answers with the request as it came, /chunk
+	in chunks, /close by closing the connection, and /once so that the
+	connection closes unanswered on the next request, as a kept-alive
+	one may at any time.
+	"""
+
+	def handle(self):
+		once = False
+		while True:
+			line = self.rfile.readline()
+			if not line or once:
+				return
+			method, target = line.split()[:2]
+			head = line
+			length = 0
+			while True:
+				h = self.rfile.readline()
+				head += h
+				if h in (b'\r\n', b''):
+					break
+				if h.lower().startswith(b'content-length:'):
+					length = int(h.split(b':')[1])
+			head += self.rfile.read(length)
+			path = target.split(b'?')[0]
+			if path.endswith(b'/chunk'):
+				self.wfile.write(b'HTTP/1.1 200 OK\r\n'
+				    b'Transfer-Encoding: chunked\r\n\r\n'
+				    b'4\r\none \r\n4\r\ntwo \r\n0\r\n\r\n')
+				continue
+			if path.endswith(b'/close'):
+				self.wfile.write(b'HTTP/1.0 200 OK\r\n\r\nuntil close')
+				return
+			once = path.endswith(b'/once')
+			body = b'' if method == b'HEAD' else head
+			self.wfile.write(b'HTTP/1.1 200 OK\r\n'
+			    b'Content-Length: %d\r\n\r\n' % len(head) + body)
+
+
+def backend():
+	socketserver.ThreadingTCPServer.daemon_threads = True
+	srv = socketserver.ThreadingTCPServer((HOST, 0), Backend)
+	threading.Thread(target=srv.serve_forever, daemon=True).start()
+	return srv.server_address[1]
+
+
+def test_proxy(files):
+	res = fetch('GET', '/api/echo?q=%2F&r')
+	check('proxied', res.status == 200 and
+	    res.body.startswith(b'GET /api/echo?q=%2F&r HTTP/1.1\r\n') and
+	    b'X-Forwarded-For: 127.0.0.1' in res.body)
+	c = Conn()
+	c.send(request('POST', '/api/echo', body=b'the body') +
+	    request('HEAD', '/api/echo') + request('GET', '/api/chunk') +
+	    request('GET', '/%s/b.txt' % DIR))
+	check('body', c.response().body.endswith(b'\r\n\r\nthe body'))
+	res = c.response(head=True)
+	check('HEAD', res.status == 200 and res.header('Content-Length'))
+	check('chunked', c.response().body == b'one two ')
+	check('static after', c.response().body == files['b.txt'])
+	c.close()
+	check('until close', fetch('GET', '/api/close').body == b'until close')
+	# the backend gets one length, the one the body was read by
+	c = Conn()
+	c.send(b'POST /api/echo HTTP/1.1\r\nHost: test\r\nContent-Length: 3\r\n'
+	    b'content-length: 3\r\n\r\nabc' + b'POST /api/echo HTTP/1.1\r\n'
+	    b'Host: test\r\nContent-Length: 3\r\nContent-Length: 30\r\n\r\nabc')
+	res = c.response()
+	check('one length', res.body.lower().count(b'content-length') == 1 and
+	    b'\r\nContent-Length: 3\r\n' in res.body and
+	    res.body.endswith(b'\r\n\r\nabc'))
+	check('two lengths', c.response().status == 400)
+	c.close()
+	# the backend sees the path the request was routed by
+	res = fetch('GET', '/api/%%2e%%2e/%s/a.txt' % DIR)
+	check('escaped out', res.status == 200 and res.body == files['a.txt'])
+	res = fetch('GET', '/api/../%s/a.txt' % DIR)
+	check('dotted out', res.status == 200 and res.body == files['a.txt'])
+	res = fetch('GET', '//api/./x/../%65cho')
+	check('normalized', res.body.startswith(b'GET /api/echo HTTP/1.1'))
+	# HTTP/1.0 may leave out Host; the backend gets its own address
+	c = Conn()
+	c.send(b'GET /api/echo HTTP/1.0\r\n\r\n')
+	check('Host', b'\r\nHost: 127.0.0.1:' in c.response().body)
+	c.close()
+	# a kept-alive connection that closes is retried only if it's safe
+	c = Conn()
+	c.send(request('GET', '/api/once'))
+	c.response()
+	c.send(request('GET', '/api/echo'))
+	check('retried', c.response().status == 200)
+	c.send(request('POST', '/api/once', body=b'x'))
+	c.response()
+	c.send(request('POST', '/api/echo', body=b'x'))
+	check('not retried', c.response().status == 502)
+	c.close()
+	check('refused', fetch('GET', '/dead/x').status == 502)
+
+
+def start(args):
+	server = os.path.join(os.getcwd(), 'server')
+	try:
+		socket.create_connection((HOST, PORT)).close()
+		sys.exit('port %d is in use' % PORT)
+	except ConnectionRefusedError:
+		pass
+	proc = subprocess.Popen([server] + args, start_new_session=True,
+	    stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	for i in range(50):
+		try:
+			socket.create_connection((HOST, PORT)).close()
+			return proc
+		except OSError:
+			if proc.poll() is not None:
+				break
+			time.sleep(0.1)
+	stop(proc)
+	sys.exit('server did not start')
+
+
+def stop(proc):
+	# the workers are in the server's process group
+	try:
+		os.killpg(proc.pid, signal.SIGTERM)
+		proc.wait(5)
+	except (ProcessLookupError, subprocess.TimeoutExpired):
+		os.killpg(proc.pid, signal.SIGKILL)
+		proc.wait()
+
+
+def main():
+	os.chdir(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+	    '..'))
+	files = {
+		'a.txt': b'alpha\n' * 10,
+		'b.txt': b'bravo\n',
+		'big.bin': bytes(range(256)) * 1024,
+	}
+	scratch = os.path.join(ROOT, DIR)
+	try:
+		os.makedirs(scratch, exist_ok=True)
+	except OSError as e:
+		sys.exit('cannot create %s: %s' % (scratch, e.strerror))
+	for name, data in files.items():
+		with open(os.path.join(scratch, name), 'wb') as f:
+			f.write(data)
+	# nothing listens on a port just closed
+	s = socket.socket()
+	s.bind((HOST, 0))
+	dead = s.getsockname()[1]
+	s.close()
+	proc = None
+	try:
+		proc = start(sys.argv[1:] + ['-u', '/api=%s:%d' % (HOST,
+		    backend()), '-u', '/dead=%s:%d' % (HOST, dead)])
+		for test in (test_parser, test_head, test_ranges,
+		    test_conditional, test_cache, test_router, test_proxy):
+			try:
+				test(files)
+			except (OSError, EOFError, ValueError, IndexError) as e:
+				check('%s: %r' % (test.__name__, e), False)
+	finally:
+		if proc is not None:
+			stop(proc)
+		shutil.rmtree(scratch)
+	print('%d of %d checks passed' % (checks - failures, checks))
+	sys.exit(failures != 0)
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,184 @@
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define LEVEL_SPAN(level) ((uint64_t)1 << (TIMER_LEVEL_BITS * (level)))
+
+static uint64_t
+timer_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+timer_ticks(void)
+{
+	return timer_ms() / TIMER_TICK_MS;
+}
+
+void
+wheel_init(struct wheel *w)
+{
+	int i, j;
+
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			LIST_INIT(&w->slots[i][j]);
+	w->now = timer_ticks();
+	w->count = 0;
+}
+
+void
+timer_init(struct timer *t, void (*cb)(void *), void *arg)
+{
+	t->armed = 0;
+	t->cb = cb;
+	t->arg = arg;
+}
+
+/*
+ * Link t into the slot that covers its expiry, as seen from w->now. A
+ * timer due now goes in the current slot, which wheel_advance() runs
+ * right after cascading.
+ */
+static void
+wheel_link(struct wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	int level;
+
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+	if (delta >= LEVEL_SPAN(TIMER_LEVELS))
+		expires = w->now + LEVEL_SPAN(TIMER_LEVELS) - 1;
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < LEVEL_SPAN(level + 1))
+			break;
+	LIST_INSERT_HEAD(&w->slots[level]
+	    [(expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)],
+	    t, entry);
+}
+
+/*
+ * (Re)arm t to fire ms from now, rounded up to the next tick. Now is
+ * the clock's: the wheel may lag it by as long as it had nothing due.
+ */
+void
+timer_set(struct wheel *w, struct timer *t, unsigned int ms)
+{
+	if (t->armed)
+		LIST_REMOVE(t, entry);
+	else
+		w->count++;
+	t->armed = 1;
+	t->expires = timer_ticks() + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (t->expires <= w->now)
+		t->expires = w->now + 1;
+	wheel_link(w, t);
+}
+
+void
+timer_cancel(struct wheel *w, struct timer *t)
+{
+	if (!t->armed)
+		return;
+	LIST_REMOVE(t, entry);
+	t->armed = 0;
+	w->count--;
+}
+
+/* move the timers of an upper level slot down, closer to expiry */
+static void
+wheel_cascade(struct wheel *w, int level)
+{
+	struct timer_slot *slot;
+	struct timer *t;
+
+	slot = &w->slots[level]
+	    [(w->now >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+	while ((t = LIST_FIRST(slot)) != NULL) {
+		LIST_REMOVE(t, entry);
+		wheel_link(w, t);
+	}
+}
+
+/*
+ * The next tick that has work for the wheel: a level 0 slot with
+ * timers expiring, or an upper level slot to cascade, whichever comes
+ * first. 0 if the wheel holds no timers.
+ */
+uint64_t
+wheel_next(struct wheel *w)
+{
+	uint64_t next = UINT64_MAX, base;
+	int level, shift, k;
+
+	if (w->count == 0)
+		return 0;
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		shift = TIMER_LEVEL_BITS * level;
+		base = w->now >> shift;
+		/* a level's slots come up no sooner than its next boundary */
+		if (((base + 1) << shift) >= next)
+			break;
+		for (k = 1; k <= TIMER_SLOTS; k++)
+			if (!LIST_EMPTY(&w->slots[level]
+			    [(base + k) & (TIMER_SLOTS - 1)])) {
+				if (((base + k) << shift) < next)
+					next = (base + k) << shift;
+				break;
+			}
+	}
+	return next;
+}
+
+/* milliseconds from now until tick begins, 0 if it has */
+unsigned int
+wheel_ms(uint64_t tick)
+{
+	uint64_t now = timer_ms();
+
+	return tick * TIMER_TICK_MS > now ? tick * TIMER_TICK_MS - now : 0;
+}
+
+/*
+ * Catch up with the clock, running the callbacks of every timer that
+ * expires; ticks with nothing to do are skipped. A callback may arm or
+ * cancel any timer, its own included.
+ */
+void
+wheel_advance(struct wheel *w)
+{
+	struct timer_slot *slot;
+	struct timer *t;
+	uint64_t target = timer_ticks(), next;
+	int level;
+
+	while (w->now < target) {
+		if ((next = wheel_next(w)) == 0 || next > target) {
+			w->now = target;
+			break;
+		}
+		w->now = next;
+		/* highest level first, so nothing lands in a slot already passed */
+		for (level = 1; level < TIMER_LEVELS; level++)
+			if ((w->now & (LEVEL_SPAN(level) - 1)) != 0)
+				break;
+		while (--level > 0)
+			wheel_cascade(w, level);
+		slot = &w->slots[0][w->now & (TIMER_SLOTS - 1)];
+		while ((t = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(t, entry);
+			t->armed = 0;
+			w->count--;
+			t->cb(t->arg);
+		}
+	}
+}
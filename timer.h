@@ -0,0 +1,44 @@
+#ifndef timer_h
+#define timer_h
+
+#include <sys/queue.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS (100)
+#define TIMER_LEVEL_BITS (6)
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS (4)	/* 64^4 ticks, about 19 days */
+
+/*
+ * Hierarchical timing wheel. Timers are embedded in their owner and
+ * linked into the slot of the tick they expire on, so arming and
+ * cancelling are O(1); when the wheel reaches a slot of an upper
+ * level, its timers are spread over the level below. Time is counted
+ * in ticks of TIMER_TICK_MS on the monotonic clock.
+ */
+struct timer {
+	LIST_ENTRY(timer) entry;
+	uint64_t expires;	/* tick */
+	int armed;
+	void (*cb)(void *);
+	void *arg;
+};
+LIST_HEAD(timer_slot, timer);
+
+struct wheel {
+	uint64_t now;		/* last tick processed */
+	struct timer_slot slots[TIMER_LEVELS][TIMER_SLOTS];
+	size_t count;
+};
+
+void	 wheel_init(struct wheel *);
+uint64_t wheel_next(struct wheel *);
+unsigned int wheel_ms(uint64_t);
+void	 wheel_advance(struct wheel *);
+void	 timer_init(struct timer *, void (*)(void *), void *);
+void	 timer_set(struct wheel *, struct timer *, unsigned int ms);
+void	 timer_cancel(struct wheel *, struct timer *);
+
+#endif
@@ -0,0 +1,94 @@
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upstream.h"
+
+static int
+upstream_backend(struct sockaddr_in *sin, const char *s, size_t len)
+{
+	char host[INET_ADDRSTRLEN];
+	const char *colon;
+	char *end;
+	long port;
+
+	if ((colon = memchr(s, ':', len)) == NULL ||
+	    (size_t)(colon - s) >= sizeof(host))
+		return -1;
+	memcpy(host, s, colon - s);
+	host[colon - s] = '\0';
+	errno = 0;
+	port = strtol(colon + 1, &end, 10);
+	if (errno != 0 || end != s + len || end == colon + 1 || port < 1 ||
+	    port > 65535)
+		return -1;
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Parse "/prefix=addr:port[,addr:port...]" into a group whose route is
+ * the prefix followed by a "*" segment. Backends are numeric IPv4.
+ */
+int
+upstream_parse(struct upstream *up, const char *spec)
+{
+	const char *eq, *p, *comma;
+	size_t plen;
+
+	memset(up, 0, sizeof(*up));
+	if (*spec != '/' || (eq = strchr(spec, '=')) == NULL)
+		goto invalid;
+	plen = eq - spec;
+	while (plen > 0 && spec[plen - 1] == '/')
+		plen--;
+	if ((size_t)snprintf(up->pattern, sizeof(up->pattern), "%.*s/*",
+	    (int)plen, spec) >= sizeof(up->pattern))
+		goto invalid;
+	for (p = eq + 1; ; p = comma + 1) {
+		if ((comma = strchr(p, ',')) == NULL)
+			comma = p + strlen(p);
+		if (up->nbackends == UPSTREAM_BACKENDS_MAX ||
+		    upstream_backend(&up->backends[up->nbackends], p,
+		    comma - p) == -1)
+			goto invalid;
+		up->nbackends++;
+		if (*comma == '\0')
+			break;
+	}
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * The backend with the fewest requests in flight from this worker;
+ * ties go round the group so an idle one doesn't take everything.
+ */
+int
+upstream_pick(const struct upstream *up, struct upstream_load *load)
+{
+	unsigned int best = 0;
+	int i, b, pick = -1;
+
+	for (i = 0; i < up->nbackends; i++) {
+		b = (load->next + i) % up->nbackends;
+		if (pick == -1 || load->outstanding[b] < best) {
+			pick = b;
+			best = load->outstanding[b];
+		}
+	}
+	load->next = (pick + 1) % up->nbackends;
+	return pick;
+}
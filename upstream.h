@@ -0,0 +1,29 @@
+#ifndef upstream_h
+#define upstream_h
+
+#include <netinet/in.h>
+
+#define UPSTREAMS_MAX (8)
+#define UPSTREAM_BACKENDS_MAX (16)
+
+/*
+ * A group of interchangeable backends that requests under one path
+ * prefix are proxied to. Configured once and shared; what each worker
+ * has in flight to each backend is its own, in an upstream_load.
+ */
+struct upstream {
+	char pattern[256];	/* the route: the prefix and a "*" segment */
+	int nbackends;
+	struct sockaddr_in backends[UPSTREAM_BACKENDS_MAX];
+	int id;			/* index among the configured groups */
+};
+
+struct upstream_load {
+	unsigned int outstanding[UPSTREAM_BACKENDS_MAX];
+	unsigned int next;	/* where a tie is broken from, rotated */
+};
+
+int	upstream_parse(struct upstream *, const char *spec);
+int	upstream_pick(const struct upstream *, struct upstream_load *);
+
+#endif
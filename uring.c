@@ -0,0 +1,274 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define URING_FEATURES (IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_NODROP)
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned int op, void *arg, unsigned int nargs)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static void
+uring_unmap(struct uring *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED &&
+	    r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+}
+
+/*
+ * Set up a ring of `entries' submissions for the calling thread only,
+ * falling back to default flags on kernels that predate them. Fails
+ * with ENOSYS if the kernel lacks a feature the rest of this relies on.
+ */
+int
+uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *array, i;
+	char *sq, *cq;
+	int error;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER;
+	if ((r->fd = uring_setup(entries, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		r->fd = uring_setup(entries, &p);
+	}
+	if (r->fd == -1)
+		return -1;
+	if ((p.features & URING_FEATURES) != URING_FEATURES) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	r->features = p.features;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	/* entries are always used in order, so the index array is fixed */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	error = errno;
+	uring_unmap(r);
+	close(r->fd);
+	errno = error;
+	return -1;
+}
+
+/* tear down the ring; the kernel drops everything registered with it */
+void
+uring_free(struct uring *r)
+{
+	uring_unmap(r);
+	close(r->fd);
+}
+
+/*
+ * Make room for n entries, submitting what is queued if the ring is
+ * too full. The next n uring_sqe() calls then succeed without a submit
+ * in between, so a linked chain reaches the kernel whole.
+ */
+int
+uring_reserve(struct uring *r, unsigned int n)
+{
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n >
+	    r->sq_entries) {
+		uring_submit(r);
+		if (r->sqe_tail - __atomic_load_n(r->sq_head,
+		    __ATOMIC_ACQUIRE) + n > r->sq_entries) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A zeroed submission entry, queued behind the others. If the ring is
+ * full, what is queued is submitted first; NULL if even that fails.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring_reserve(r, 1) == -1)
+		return NULL;
+	sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqe_tail++;
+	return sqe;
+}
+
+/*
+ * Hand every queued entry to the kernel without waiting for any of
+ * them. Entries the kernel could not take yet stay queued for the
+ * next call. Returns how many were submitted.
+ */
+int
+uring_submit(struct uring *r)
+{
+	unsigned int n = r->sqe_tail - r->sqe_head;
+	int ret;
+
+	if (n == 0)
+		return 0;
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	while ((ret = uring_enter(r->fd, n, 0, 0)) == -1 && errno == EINTR)
+		; /* empty */
+	if (ret > 0)
+		r->sqe_head += ret;
+	return ret;
+}
+
+/* the oldest unseen completion, or NULL */
+struct io_uring_cqe *
+uring_cqe(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* register an empty table of `nfiles' fixed files */
+int
+uring_files(struct uring *r, unsigned int nfiles)
+{
+	struct io_uring_rsrc_register reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nfiles;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	return uring_register(r->fd, IORING_REGISTER_FILES2, &reg, sizeof(reg));
+}
+
+/* `nbufs' must be a power of two */
+int
+uring_bufs_init(struct uring *r, struct uring_bufs *b, int bgid,
+    unsigned int nbufs, unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+	int error;
+
+	memset(b, 0, sizeof(*b));
+	b->ring_size = nbufs * sizeof(struct io_uring_buf);
+	b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->ring == MAP_FAILED)
+		return -1;
+	if ((b->base = malloc((size_t)nbufs * size)) == NULL) {
+		munmap(b->ring, b->ring_size);
+		return -1;
+	}
+	b->size = size;
+	b->mask = nbufs - 1;
+	b->bgid = bgid;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)b->ring;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		error = errno;
+		free(b->base);
+		munmap(b->ring, b->ring_size);
+		errno = error;
+		return -1;
+	}
+	for (i = 0; i < nbufs; i++)
+		uring_buf_recycle(b, i);
+	return 0;
+}
+
+char *
+uring_buf(struct uring_bufs *b, unsigned int bid)
+{
+	return b->base + (size_t)bid * b->size;
+}
+
+/* give a buffer back to the kernel once its contents are consumed */
+void
+uring_buf_recycle(struct uring_bufs *b, unsigned int bid)
+{
+	struct io_uring_buf *buf = &b->ring->bufs[b->tail & b->mask];
+
+	buf->addr = (uintptr_t)uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+	__atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,69 @@
+#ifndef uring_h
+#define uring_h
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Just enough of io_uring for one thread, on the raw system calls.
+ * Submission entries are handed out in order and sent to the kernel
+ * in one batch by uring_submit(); completions are read straight off
+ * the shared ring. The kernel must report IORING_FEAT_SUBMIT_STABLE,
+ * so anything an entry points to only has to live until it is
+ * submitted, and IORING_FEAT_NODROP, so completions are never lost.
+ */
+struct uring {
+	int fd;
+	unsigned int features;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_tail;		/* entries handed out */
+	unsigned int sqe_head;		/* entries given to the kernel */
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/*
+ * A ring of equal-sized buffers the kernel picks from for receives
+ * issued with IOSQE_BUFFER_SELECT on group `bgid'; a completion names
+ * the buffer it filled, which goes back with uring_buf_recycle().
+ */
+struct uring_bufs {
+	struct io_uring_buf_ring *ring;
+	char *base;
+	size_t ring_size;
+	unsigned int size;		/* of each buffer */
+	unsigned int mask;
+	uint16_t tail;
+	int bgid;
+};
+
+int			 uring_init(struct uring *, unsigned int entries);
+void			 uring_free(struct uring *);
+int			 uring_reserve(struct uring *, unsigned int);
+struct io_uring_sqe	*uring_sqe(struct uring *);
+int			 uring_submit(struct uring *);
+struct io_uring_cqe	*uring_cqe(struct uring *);
+void			 uring_cqe_seen(struct uring *);
+int			 uring_files(struct uring *, unsigned int nfiles);
+int			 uring_bufs_init(struct uring *, struct uring_bufs *, int bgid,
+			    unsigned int nbufs, unsigned int size);
+char			*uring_buf(struct uring_bufs *, unsigned int bid);
+void			 uring_buf_recycle(struct uring_bufs *, unsigned int bid);
+
+#endif
@@ -0,0 +1,320 @@
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <brotli/encode.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "zcache.h"
+
+#define ZCACHE_BUCKETS (1024)
+
+enum {
+	ZENTRY_FILLING,		/* a pool thread is compressing it */
+	ZENTRY_READY,
+	ZENTRY_USELESS,		/* didn't shrink; remembered so it isn't retried */
+};
+
+struct zentry {
+	LIST_ENTRY(zentry) chain;
+	TAILQ_ENTRY(zentry) lru;
+	int listed;
+	unsigned int refs;	/* the cache's while listed, plus each user's */
+	int state;
+	int enc;
+	uint64_t hash;
+
+	/* the file the variant is made from */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	char *data;
+	size_t len;
+	size_t cost;		/* charged against the budget while listed */
+	char path[];
+};
+
+struct zcache {
+	pthread_mutex_t lock;
+	LIST_HEAD(, zentry) buckets[ZCACHE_BUCKETS];
+	TAILQ_HEAD(zentry_lru, zentry) lru;
+	size_t size;
+	size_t used;
+	struct zcache_stats stats;
+};
+
+static uint64_t
+zcache_hash(const char *path, int enc)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= enc;
+	h *= 0x100000001b3ULL;
+	return h;
+}
+
+struct zcache *
+zcache_create(size_t size)
+{
+	struct zcache *zc;
+	size_t i;
+
+	if ((zc = calloc(1, sizeof(*zc))) == NULL)
+		return NULL;
+	pthread_mutex_init(&zc->lock, NULL);
+	for (i = 0; i < ZCACHE_BUCKETS; i++)
+		LIST_INIT(&zc->buckets[i]);
+	TAILQ_INIT(&zc->lru);
+	zc->size = size;
+	return zc;
+}
+
+/* the largest file worth a variant: no single one may crowd out the rest */
+size_t
+zcache_max_file(struct zcache *zc)
+{
+	return zc->size / 8 < ZCACHE_MAX_FILE ? zc->size / 8 : ZCACHE_MAX_FILE;
+}
+
+static int
+zentry_same_file(const struct zentry *e, const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino &&
+	    e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	    e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* drop a reference; caller holds the lock */
+static void
+zentry_release(struct zentry *e)
+{
+	if (--e->refs > 0)
+		return;
+	free(e->data);
+	free(e);
+}
+
+static void
+zentry_unlist(struct zcache *zc, struct zentry *e)
+{
+	LIST_REMOVE(e, chain);
+	TAILQ_REMOVE(&zc->lru, e, lru);
+	zc->used -= e->cost;
+	e->listed = 0;
+	zentry_release(e);
+}
+
+/*
+ * The ready `enc' variant of path, which must still be the file st
+ * describes; NULL if there is none yet. On a miss with nothing under
+ * way, *fill is set to a new entry the caller must zcache_fill() off
+ * the event loop; otherwise it is set to NULL. A returned entry stays
+ * valid until zcache_put().
+ */
+struct zentry *
+zcache_get(struct zcache *zc, const char *path, int enc,
+    const struct stat *st, struct zentry **fill)
+{
+	struct zentry *e;
+	uint64_t h = zcache_hash(path, enc);
+	size_t len;
+
+	*fill = NULL;
+	pthread_mutex_lock(&zc->lock);
+	LIST_FOREACH(e, &zc->buckets[h % ZCACHE_BUCKETS], chain)
+		if (e->hash == h && e->enc == enc && strcmp(e->path, path) == 0)
+			break;
+	if (e != NULL && !zentry_same_file(e, st)) {
+		zentry_unlist(zc, e);
+		e = NULL;
+	}
+	if (e == NULL) {
+		zc->stats.misses++;
+		len = strlen(path);
+		if ((e = calloc(1, sizeof(*e) + len + 1)) != NULL) {
+			memcpy(e->path, path, len + 1);
+			e->hash = h;
+			e->enc = enc;
+			e->state = ZENTRY_FILLING;
+			e->dev = st->st_dev;
+			e->ino = st->st_ino;
+			e->size = st->st_size;
+			e->mtime = st->st_mtim;
+			e->cost = sizeof(*e) + len + 1;
+			e->listed = 1;
+			e->refs = 2;
+			LIST_INSERT_HEAD(&zc->buckets[h % ZCACHE_BUCKETS], e,
+			    chain);
+			TAILQ_INSERT_HEAD(&zc->lru, e, lru);
+			zc->used += e->cost;
+			*fill = e;
+		}
+		pthread_mutex_unlock(&zc->lock);
+		return NULL;
+	}
+	if (e->state != ZENTRY_READY) {
+		zc->stats.misses++;
+		pthread_mutex_unlock(&zc->lock);
+		return NULL;
+	}
+	zc->stats.hits++;
+	e->refs++;
+	TAILQ_REMOVE(&zc->lru, e, lru);
+	TAILQ_INSERT_HEAD(&zc->lru, e, lru);
+	pthread_mutex_unlock(&zc->lock);
+	return e;
+}
+
+const char *
+zentry_data(struct zentry *e, size_t *len)
+{
+	*len = e->len;
+	return e->data;
+}
+
+void
+zcache_put(struct zcache *zc, struct zentry *e)
+{
+	pthread_mutex_lock(&zc->lock);
+	zentry_release(e);
+	pthread_mutex_unlock(&zc->lock);
+}
+
+static char *
+zcache_gzip(const char *in, size_t inlen, size_t *outlen)
+{
+	z_stream zs;
+	char *out;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 more window bits ask for a gzip wrapper */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+	*outlen = deflateBound(&zs, inlen);
+	if ((out = malloc(*outlen)) == NULL) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+	zs.next_in = (unsigned char *)in;
+	zs.avail_in = inlen;
+	zs.next_out = (unsigned char *)out;
+	zs.avail_out = *outlen;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+static char *
+zcache_brotli(const char *in, size_t inlen, size_t *outlen)
+{
+	char *out;
+
+	*outlen = BrotliEncoderMaxCompressedSize(inlen);
+	if (*outlen == 0 || (out = malloc(*outlen)) == NULL)
+		return NULL;
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+	    BROTLI_MODE_TEXT, inlen, (const uint8_t *)in, outlen,
+	    (uint8_t *)out)) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/* the whole file, if it is still the one the entry was made for */
+static char *
+zcache_read(struct zentry *e, int fd)
+{
+	struct stat st;
+	char *buf;
+	size_t done = 0;
+	ssize_t n;
+
+	if (fstat(fd, &st) == -1 || !zentry_same_file(e, &st) ||
+	    (buf = malloc(st.st_size)) == NULL)
+		return NULL;
+	while (done < (size_t)st.st_size) {
+		n = pread(fd, buf + done, st.st_size - done, done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return NULL;
+		}
+		done += n;
+	}
+	return buf;
+}
+
+/*
+ * Make the variant of an entry zcache_get() handed out to fill: read
+ * and compress the file, open on fd, then publish the result, evicting the least
+ * recently used entries to stay in budget. Slow; never call it on an
+ * event loop. A variant that doesn't save a tenth is not kept, only
+ * remembered, and a failure unlists the entry so a later miss retries.
+ */
+void
+zcache_fill(struct zcache *zc, struct zentry *e, int fd)
+{
+	char *in, *out = NULL;
+	size_t outlen = 0;
+
+	if ((in = zcache_read(e, fd)) != NULL) {
+		if (e->enc == ENC_BR)
+			out = zcache_brotli(in, e->size, &outlen);
+		else
+			out = zcache_gzip(in, e->size, &outlen);
+		free(in);
+	}
+
+	pthread_mutex_lock(&zc->lock);
+	if (!e->listed)
+		free(out);
+	else if (out == NULL)
+		zentry_unlist(zc, e);
+	else if (outlen > (size_t)e->size - e->size / 10) {
+		free(out);
+		e->state = ZENTRY_USELESS;
+	} else {
+		e->data = out;
+		e->len = outlen;
+		e->state = ZENTRY_READY;
+		e->cost += outlen;
+		zc->used += outlen;
+		zc->stats.fills++;
+		while (zc->used > zc->size &&
+		    TAILQ_LAST(&zc->lru, zentry_lru) != NULL) {
+			zentry_unlist(zc, TAILQ_LAST(&zc->lru, zentry_lru));
+			zc->stats.evictions++;
+		}
+	}
+	zentry_release(e);
+	pthread_mutex_unlock(&zc->lock);
+}
+
+void
+zcache_stats(struct zcache *zc, struct zcache_stats *st)
+{
+	pthread_mutex_lock(&zc->lock);
+	*st = zc->stats;
+	st->bytes = zc->used;
+	pthread_mutex_unlock(&zc->lock);
+}
@@ -0,0 +1,48 @@
+#ifndef zcache_h
+#define zcache_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZCACHE_MIN_FILE (256)		/* smaller files aren't worth it */
+#define ZCACHE_MAX_FILE (1024 * 1024)
+
+/* content codings, in the order we prefer them */
+enum {
+	ENC_BR,
+	ENC_GZIP,
+	ENC_IDENTITY,
+	ENC_MAX,
+};
+
+/*
+ * Compressed variants of files that have no precompressed sidecar,
+ * made once off the event loop and kept in memory up to a byte budget,
+ * least recently used first out. Shared by the threads of a process.
+ * Entries remember the identity of the file they were made from, so a
+ * lookup with a changed file misses and makes a new one.
+ */
+struct zcache;
+struct zentry;
+
+struct zcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;
+	uint64_t evictions;
+	size_t bytes;
+};
+
+struct zcache	*zcache_create(size_t size);
+size_t		 zcache_max_file(struct zcache *);
+struct zentry	*zcache_get(struct zcache *, const char *path, int enc,
+		    const struct stat *, struct zentry **fill);
+const char	*zentry_data(struct zentry *, size_t *len);
+void		 zcache_put(struct zcache *, struct zentry *);
+void		 zcache_fill(struct zcache *, struct zentry *, int fd);
+void		 zcache_stats(struct zcache *, struct zcache_stats *);
+
+#endif